@@ -1,354 +1,183 @@
-// REST API for notera web app
+// Entry point of the notera API executable (see handler.cpp for the API).
 //
-// /session
-//     GET   : Returns the current state of the session.
-//             Returned values:
-//                 - auth : 1 if session is authenticated, 0 otherwise.
-//                 - user : the user associated with the session, if any.
-//                 - salt : the salt associated with the user, if any.
-//     POST  : Authenticate session (login).
-//             Parameters:
-//                 - token: the security token, defined as follows:
-//                          SHA1(user + SHA1(pwd + salt) + sid)
-//             Returned values:
-//                 - auth : 1 if authentication was accepted, 0 otherwise.
-//     DELETE: Delete the current session (logout).
+// The executable runs either as a classic CGI program, handling a single
+// request and exiting, or as a persistent FastCGI responder that keeps the
+// database open across requests. FastCGI mode is used when the web server
+// spawns the process with a listening socket as stdin, or when started with
+// "--fcgi [host:]port". In FastCGI mode, the connections are read by an
+// event loop, and their requests handled by a pool of worker threads
+// ("--threads N", one per core by default), each with its own database
+// connection. "--session-cache" caches sessions in memory; it must not be
+// used when the web server runs several FastCGI processes on the same
+// database. "--session-tokens" makes authenticated sessions use signed
+// cookies instead of the session table (see session_tokens.h); logouts are
+// then only known to the process that served them.
 //
-// /session/<user>
-//     PUT   : Associate the session with a specific user.
-//             Returned values:
-//                 - salt : the salt associated with the user.
+// The time spent in each phase of the requests is measured. In FastCGI
+// mode, latency histograms are served at <script>/metrics in the Prometheus
+// text format. In CGI mode, the times of each request are appended to the
+// file named by the NOTERA_METRICS_FILE environment variable, if set.
 //
-// /user/<user>
-//     POST  : Create a new user. 
-//             Parameters:
-//                 - pwd_hash: SHA1(pwd + salt)
-//
-// /note
-//     GET   : Get the list of notes
-//     POST  : Create a new note
-//             Returned values:
-//                 - id: the id of the new note
-//
-// /note/<id>
-//     GET   : Get the contents of the note
-//             Returned values:
-//                 - title
-//                 - text
-//     PUT   : Update the contents of the note
-//             Parameters:
-//                 - title
-//                 - text
-//     DELETE: Delete the note
+// NOTERA_REVISION_CHAIN sets the maximum number of deltas between full
+// snapshots in the notes' revision history (16 by default); more saves
+// mean less storage, and slower reads of old revisions.
 
 #include "db.h"
-#include "sha1.h"
-#include "sqlite_wrapper.h"
+#include "fcgi.h"
+#include "handler.h"
+#include "log_writer.h"
+#include "metrics.h"
+#include "session_cache.h"
+#include "session_tokens.h"
 #include "util.h"
+#include "worker_pool.h"
 
-#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
-#include <map>
 #include <memory>
-#include <sstream>
+
+#include <unistd.h>
 
 #include <boost/lexical_cast.hpp>
-#include <boost/tokenizer.hpp>
 
 using namespace boost;
 using namespace std;
 
-typedef tokenizer<char_separator<char>> char_tok;
-typedef char_separator<char> char_sep;
-
-const long max_session_age = 7 * 24 * 3600;
-
-int64_t gen_sid(DB& db)
+namespace
 {
-    int64_t sid = db.random_int64();
-    if (sid < 0)
-    {
-        sid += 1; // Add 1 to avoid overflowing, if the negative number was
-                  // the smallest one possible
-        sid *= -1;
-    }
-    if (sid == 0) return 1;
-    return sid;
-}
+    const char* db_path = "db.sqlite3";
 
-map<string, string> parse_env(char* env[])
-{
-    map<string, string> m;
-    while (*env)
+    string read_post(const Env& env)
     {
-        string s(*env);
-        string::size_type pos = s.find_first_of('=');
-        CHECK(pos != string::npos, "Invalid environment string: %s", *env)
-        m[s.substr(0, pos)] = s.substr(pos + 1);
-        ++env;
+        string raw;
+        string_view len = env["CONTENT_LENGTH"];
+        if (!len.empty())
+        {
+            long content_len = lexical_cast<long>(len.data(), len.size());
+            raw.resize(content_len);
+            raw.resize(fread(&raw[0], 1, content_len, stdin));
+        }
+        return raw;
     }
-    return m;
-}
 
-map<string, string> build_map(const string& s,
-                              const string& pair_delim,
-                              const string& pair_item_delim)
-{
-    map<string, string> m;
-    char_tok tok(s, char_sep(pair_delim.c_str()));
-    foreach_(const string& pair_string, tok)
+    int run_cgi(char* envp[])
     {
-        char_tok tok2(pair_string, char_sep(pair_item_delim.c_str()));
-        vector<string> v(tok2.begin(), tok2.end());
-        if (v.size() > 1) m[v[0]] = v[1];
-    }
-    return m;
-}
+        Request req;
+        Resp    resp;
+        try
+        {
+            req.env  = parse_env(envp);
+            req.body = read_post(req.env);
+            req.timer.phase("read");
+            DB db(db_path);
+            req.timer.phase("db_open");
+            handle_request(db, req, resp);
+        }
+        catch (const std::exception& ex)
+        {
+            resp.data["error"] = ex.what();
+        }
+        resp.emit(STDOUT_FILENO);
+        req.timer.phase("emit");
 
-class Resp
-{
-public:
-    void set_cookie(const string& name, const string& value, long max_age)
-    {
-        headers.push_back(fmt("Set-Cookie: %1%=%2%; Max-Age=%3%; HttpOnly",
-                              name, value, max_age));
+        const char* metrics_file = getenv("NOTERA_METRICS_FILE");
+        if (metrics_file) Metrics::append(metrics_file, req.timer);
+        return 0;
     }
 
-    void emit()
+    long thread_count(int argc, char* argv[])
     {
-        cout << "Content-type: " << "application/json" << endl;
-        foreach_(const auto& h, headers) cout << h << endl;
-        cout << endl << "{";
-
-
-
-        foreach_(const auto& d, data_list)
-	{
-	    cout << "\"" << d.first << "\": [";
-	    bool first = true;
-	    foreach_(const auto& e, d.second)
-	    {
-		if (!first) cout << ", ";
-		first = false;
-		cout << e;
-	    }
-	    cout << "], ";
-	}
-
-        long i = data.size();
-        foreach_(const auto& d, data)
+        for (int i = 1; i + 1 < argc; ++i)
         {
-            cout << "\"" << d.first << "\": " << "\"" << d.second << "\"";
-
-            // Do not output comma if it's the last item
-            if (--i) cout << ", ";
+            if (string(argv[i]) == "--threads") return atol(argv[i + 1]);
         }
-        cout << "}" << endl;
+        return 0;
     }
 
-    map<string, string> data;
-    map<string, vector<string>> data_list;
-
-private:
-    vector<string>      headers;
-};
-
-map<string, string> parse_post(const map<string, string>& env, string& oRaw)
-{
-    map<string, string> post_data;
-
-    auto content_len_it = env.find("CONTENT_LENGTH");
-    if (content_len_it != env.end() && !content_len_it->second.empty())
+    bool has_flag(int argc, char* argv[], const string& flag)
     {
-        long content_len = lexical_cast<long>(content_len_it->second);
-        oRaw.resize(content_len);
-        long read_len = fread(&oRaw[0], 1, content_len, stdin);
-        post_data = build_map(oRaw, "&", "=");
+        for (int i = 1; i < argc; ++i)
+        {
+            if (argv[i] == flag) return true;
+        }
+        return false;
     }
 
-    return post_data;
-}
-
-int main(int argc, char* argv[], char* envp[])
-{
-    Resp resp;
-    resp.data["auth"] = "0";
-
-    try
+    int run_fcgi(int listen_fd, long threads, bool cache_sessions,
+                 bool session_tokens)
     {
-        // Parse the request's data
-        auto env          = parse_env(envp);
-        string raw_post;
-        auto post_data    = parse_post(env, raw_post);
-        auto query_string = build_map(env["QUERY_STRING"], "&", "=");
-        auto cookies      = build_map(env["HTTP_COOKIE"] , ",", "=");
-
-        // Connect to the DB and log the request
-        DB db("db.sqlite3");
-        db.log(env);
-
-        // Get the current session ID, setting the cookie if necessary
-        string sid = cookies["sid"];
-        if (sid.empty())
+        // The connections (and the schema setup done when opening them) are
+        // shared by all the requests served by this process, which log them
+        // in batches through a single writer
+        LogWriter log_writer(db_path);
+        unique_ptr<SessionCache> session_cache;
+        if (cache_sessions) session_cache.reset(new SessionCache(db_path));
+        unique_ptr<SessionTokens> tokens;
+        if (session_tokens)
         {
-            sid = fmt("%1%", gen_sid(db));
-            resp.set_cookie("sid", sid, max_session_age);
+            tokens.reset(new SessionTokens(
+                DB(db_path).get_secret("session_token_key")));
         }
-
-        // Load the current session
-        auto ses = db.get_session(sid);
-
-        // Trace some things for debugging purposes
-        resp.data["method"] = env["REQUEST_METHOD"];
-        resp.data["p1"]     = query_string["p1"];
-        resp.data["p2"]     = query_string["p2"];
-        resp.data["step"]   = "1";
-        resp.data["raw_post"] = raw_post;
-	foreach_(const auto& i, post_data)
-	{
-	    resp.data["post_data"] += i.first + ", " + i.second + ", ";
-	}
-
-        // Process API calls
-        if (query_string["p1"] == "session")
+        WorkerPool pool(threads, db_path, &log_writer, session_cache.get());
+        SessionTokens* tokens_ptr = tokens.get();
+        Metrics metrics;
+        FcgiServer server(listen_fd,
+            [&pool, &metrics, tokens_ptr](const std::shared_ptr<Request>& req,
+                                          const FcgiServer::Reply& reply)
         {
-            // For session management API calls, return the SID cookie, to will
-            // avoid having to mess with cookies on the client side, and the
-            // cookie can be made HttpOnly
-            resp.data["sid"]    = sid;
-
-            if (env["REQUEST_METHOD"] == "GET")
+            if (req->env["PATH_INFO"] == "/metrics")
             {
-                resp.data["step"]   = "2";
-                if (ses)
-                {
-                    CHECK(!ses->user.empty(), "User name should be defined here.");
-                    resp.data["user"] = ses->user;
-                    resp.data["auth"] = fmt("%1%", ses->auth);
-                    auto u = db.get_user(ses->user);
-                    CHECK(u, "User should have already been created here", ses->user);
-                    resp.data["salt"] = u->salt;
-                }
+                string out = "Content-type: text/plain; version=0.0.4\n\n" +
+                             metrics.prometheus();
+                reply(out);
+                return;
             }
-            else if (env["REQUEST_METHOD"] == "POST")
-            {
-                CHECK(ses, "Must register a session first");
-                CHECK(!post_data["token"].empty(), "No token submitted");
 
-                resp.data["step"]   = "3";
-                // Construct the expected auth token
-                auto u = db.get_user(ses->user);
-                CHECK(u, "User not defined");
-                Sha1 sha(ses->user);
-                sha.update(u->pwd_hash);
-                sha.update(sid);
-                sha.result();
-                unsigned int* s = sha.Message_Digest;
-                string expected_auth_token = fmt("%08x%08x%08x%08x%08x", s[0],
-                                                 s[1], s[2], s[3], s[4]);
-
-                // For debug
-                resp.data["expected_auth_token"] = expected_auth_token;
-                resp.data["user"] = ses->user;
-                resp.data["pwd_hash"] = u->pwd_hash;
-                resp.data["sid"] = sid;
-
-                // Compare the expected auth token to the submitted one
-                if (expected_auth_token == post_data["token"])
-                {
-                    resp.data["step"]   = "4";
-                    // User is authenticated
-                    db.exec(fmt("UPDATE session SET auth=%1% WHERE id=%2%",
-                                1, sid));
-                    resp.data["auth"] = "1";
-                }
-                else
-                {
-                    //db.exec(fmt("DELETE FROM session WHERE id=%1%", sid));
-                }
-            }
-            else if (env["REQUEST_METHOD"] == "PUT")
+            req->timer.phase("read");
+            pool.submit([req, reply, &metrics, tokens_ptr](DB& db)
             {
-                if (ses)
+                req->timer.phase("queue");
+                string out;
+                try
                 {
-                    db.delete_session(sid);
+                    Resp resp;
+                    handle_request(db, *req, resp, tokens_ptr);
+                    resp.emit(out);
                 }
-                resp.data["step"]   = "5";
-                CHECK(!query_string["p2"].empty(), "Empty p2 parameter");
-                resp.data["step"]   = "5a";
-                auto u = db.get_user(query_string["p2"]);
-                resp.data["step"]   = "5b";
-                if (!u)
+                catch (const std::exception& ex)
                 {
-                    resp.data["step"]   = "5c";
-                    u = db.insert_user(query_string["p2"]);
+                    // The reply is still owed to the connection
+                    out = "Status: 500 Internal Server Error\n"
+                          "Content-type: text/plain\n\n";
+                    out += ex.what();
                 }
-                resp.data["step"]   = "6";
-                db.insert_session(sid, query_string["p2"]);
-                resp.data["salt"] = u->salt;
-            }
-        }
-        else if (query_string["p1"] == "user")
-        {
-            if (env["REQUEST_METHOD"] == "POST")
-            {
-                resp.data["step"]   = "7";
-                auto u = db.get_user(query_string["p2"]);
-                CHECK(u, "User %1% does not exists; please create a session "
-                         "first with PUT /session/user", query_string["p2"]);
-                CHECK(u->pwd_hash.empty(), "Request rejected");
-                db.set_user_pwd_hash(query_string["p2"],
-                                     post_data["pwd_hash"]);
-            }
-        }
-        else if (query_string["p1"] == "note")
-        {
-            CHECK(ses && ses->auth, "Unauthorized");
+                req->timer.phase("emit");
+                metrics.record(req->timer);
+                reply(out);
+            });
+        });
+        server.run();
+        return 0;
+    }
+}
 
-            if (env["REQUEST_METHOD"] == "GET")
-            {
-                if (query_string["p2"].empty())
-                {
-                    auto v = db.get_note_list(ses->user);
-                    foreach_(const auto& n, v)
-                    {
-			resp.data_list["note_list"].push_back(
-                            fmt("[%1%, \"%2%\"]", n.id, n.title));
-                    }
-                }
-		else
-		{
-		    auto n = db.get_note(query_string["p2"]);
-		    if (n)
-		    {
-			resp.data["title"]   = n->title_;
-			resp.data["content"] = n->content_;
-		    }
-		}
-            }
-            else if (env["REQUEST_METHOD"] == "POST")
-            {
-                db.exec(fmt("INSERT INTO note(user) VALUES('%1%')", ses->user));
-                resp.data["note_id"] = fmt("%1%", db.db_.last_rowid());
-            }
-	    else if (env["REQUEST_METHOD"] == "PUT")
-	    {
-		CHECK(!query_string["p2"].empty(), "p2 not provided");
-		resp.data["title"]   = post_data["title"];
-		resp.data["content"] = post_data["content"];
-		db.exec(fmt(
-		    "UPDATE note SET title='%1%', content='%2%' WHERE id=%3%",
-		    post_data["title"], post_data["content"],
-		    query_string["p2"]));
-	    }
-        }
+int main(int argc, char* argv[], char* envp[])
+{
+    int listen_fd = -1;
+    try
+    {
+        listen_fd = FcgiServer::listen_socket(argc, argv);
     }
     catch (const std::exception& ex)
     {
-        resp.data["error"] = ex.what();
+        cerr << ex.what() << endl;
+        return 1;
     }
 
-    resp.emit();
-    return 0;
+    if (listen_fd < 0) return run_cgi(envp);
+    return run_fcgi(listen_fd, thread_count(argc, argv),
+                    has_flag(argc, argv, "--session-cache"),
+                    has_flag(argc, argv, "--session-tokens"));
 }
 
@@ -1,14 +1,19 @@
 #include "db.h"
+#include "delta.h"
+#include "log_writer.h"
+#include "session_cache.h"
+#include "sha1.h"
 #include "util.h"
 
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
 #include <vector>
 
 using namespace std;
 
 namespace
 {
-    const long max_session_age = 7 * 24 * 3600;
-
     vector<string> log_env_vars{"CONTENT_LENGTH",
                                 "CONTENT_TYPE",
                                 "DOCUMENT_ROOT",
@@ -35,36 +40,445 @@ namespace
                                 "SERVER_NAME",
                                 "SERVER_PORT",
                                 "SERVER_SOFTWARE"};
+
+    // INSERT INTO log(<log_env_vars>) VALUES(?, ...); unset variables are
+    // left unbound, i.e. NULL
+    string log_insert_sql()
+    {
+        string cols;
+        string params;
+        foreach_(const string& s, log_env_vars)
+        {
+            if (!cols.empty())
+            {
+                cols   += ",";
+                params += ",";
+            }
+            cols   += s;
+            params += "?";
+        }
+        return "INSERT INTO log(" + cols + ") VALUES(" + params + ")";
+    }
+
+    const string log_insert = log_insert_sql();
+
+    // Converts a search, as typed by the user, to an FTS5 query: each word
+    // is quoted, so that punctuation and FTS5 operators are searched as
+    // is, and words ending with '*' match as prefixes. Empty if there are
+    // no words.
+    string fts_query(string_view search)
+    {
+        string q;
+        size_t i = 0;
+        for (;;)
+        {
+            while (i < search.size() && isspace((unsigned char)search[i])) ++i;
+            if (i == search.size()) break;
+            size_t end = i;
+            while (end < search.size() && !isspace((unsigned char)search[end]))
+            {
+                ++end;
+            }
+            string_view word = search.substr(i, end - i);
+            i = end;
+
+            bool prefix = word.back() == '*';
+            if (prefix) word.remove_suffix(1);
+            if (word.empty()) continue;
+            if (!q.empty()) q += ' ';
+            q += '"';
+            foreach_(char c, word)
+            {
+                if (c == '"') q += '"';
+                q += c;
+            }
+            q += '"';
+            if (prefix) q += '*';
+        }
+        return q;
+    }
+
+    string log_table_sql()
+    {
+        string sql(
+        "CREATE TABLE IF NOT EXISTS log("
+        "    id           INTEGER PRIMARY KEY,"
+        "    time         INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),");
+        foreach_(const string& s, log_env_vars) sql += fmt("%1% TEXT,", s);
+        *sql.rbegin() = ')';
+        return sql + ";";
+    }
+
+    // Merkle trees: leaves hold 16 note IDs, nodes 16 children, and the
+    // root (top level, index 0) covers IDs up to 2^52
+    const int merkle_leaf_bits   = 4;
+    const int merkle_fanout_bits = 4;
+    const int merkle_top_level   = 12;
+
+    string hex_digest(Sha1& sha)
+    {
+        sha.result();
+        unsigned* d = sha.Message_Digest;
+        return fmt("%08x%08x%08x%08x%08x", d[0], d[1], d[2], d[3], d[4]);
+    }
+
+    string note_digest(string_view title, string_view content)
+    {
+        Sha1 sha;
+        sha.update(title.data(), title.size());
+        sha.update("", 1);
+        sha.update(content.data(), content.size());
+        return hex_digest(sha);
+    }
+
+    // Hash of a Merkle tree node, from the "<index>:<hash>\n" lines of its
+    // children (empty if there are none)
+    string merkle_hash(const string& lines)
+    {
+        if (lines.empty()) return lines;
+        Sha1 sha(lines);
+        return hex_digest(sha);
+    }
+
+    // Maximum number of deltas applied to rebuild a revision, from the
+    // NOTERA_REVISION_CHAIN environment variable (16 by default): a
+    // snapshot is stored after as many deltas
+    int64_t max_revision_chain()
+    {
+        static const int64_t n = []
+        {
+            const char* s = getenv("NOTERA_REVISION_CHAIN");
+            return s ? max(atol(s), 0L) : 16L;
+        }();
+        return n;
+    }
+
+    // Schema migrations, in order: migrations()[i] upgrades the schema from
+    // version i to i + 1. The version is stored in PRAGMA user_version.
+    // Never change a migration that was released; add a new one instead.
+    const vector<string>& migrations()
+    {
+        static const vector<string> m{
+        // 1: initial schema. Databases created before versioning have the
+        // tables but version 0, hence the IF NOT EXISTS.
+        "CREATE TABLE IF  NOT EXISTS note("
+        "    id           INTEGER PRIMARY KEY,"
+        "    user         TEXT NOT NULL,"
+        "    title        TEXT NOT NULL DEFAULT '',"
+        "    content      TEXT NOT NULL DEFAULT '',"
+        "    FOREIGN KEY(user) REFERENCES user(name) ON DELETE CASCADE);"
+        "CREATE TABLE IF  NOT EXISTS session("
+        "    id           INTEGER PRIMARY KEY,"
+        "    user         TEXT NOT NULL,"
+        "    auth         INTEGER NOT NULL DEFAULT 0,"
+        "    create_time  INTEGER NOT NULL DEFAULT (strftime('%s', 'now')));"
+        "CREATE TABLE IF  NOT EXISTS user("
+        "    name         TEXT PRIMARY KEY,"
+        "    pwd_hash     TEXT NOT NULL DEFAULT '',"
+        "    salt         TEXT NOT NULL DEFAULT (RANDOM()));"
+        "CREATE TABLE IF  NOT EXISTS secret("
+        "    name         TEXT PRIMARY KEY,"
+        "    value        TEXT NOT NULL);" +
+        log_table_sql(),
+
+        // 2: indexes for listing a user's notes and reaping old sessions
+        "CREATE INDEX note_user ON note(user);"
+        "CREATE INDEX session_create_time ON session(create_time);",
+
+        // 3: full-text index of the notes, kept up to date by triggers.
+        // The text is not stored twice: the index reads it from note.
+        // Prefix indexes make short prefix queries cheap.
+        "CREATE VIRTUAL TABLE note_fts USING fts5("
+        "    title, content, content='note', content_rowid='id',"
+        "    prefix='2 3', tokenize='unicode61 remove_diacritics 2');"
+        "CREATE TRIGGER note_fts_insert AFTER INSERT ON note BEGIN"
+        "    INSERT INTO note_fts(rowid, title, content)"
+        "        VALUES(new.id, new.title, new.content);"
+        "END;"
+        "CREATE TRIGGER note_fts_delete AFTER DELETE ON note BEGIN"
+        "    INSERT INTO note_fts(note_fts, rowid, title, content)"
+        "        VALUES('delete', old.id, old.title, old.content);"
+        "END;"
+        "CREATE TRIGGER note_fts_update AFTER UPDATE OF title, content ON note "
+        "BEGIN"
+        "    INSERT INTO note_fts(note_fts, rowid, title, content)"
+        "        VALUES('delete', old.id, old.title, old.content);"
+        "    INSERT INTO note_fts(rowid, title, content)"
+        "        VALUES(new.id, new.title, new.content);"
+        "END;"
+        "INSERT INTO note_fts(note_fts) VALUES('rebuild');",
+
+        // 4: modification time of the notes, and covering indexes for
+        // listing them a page at a time, by ID or modification time.
+        // Existing notes count as modified now.
+        "ALTER TABLE note ADD COLUMN mtime INTEGER NOT NULL DEFAULT 0;"
+        "UPDATE note SET mtime = strftime('%s', 'now');"
+        "DROP INDEX note_user;"
+        "CREATE INDEX note_user_id ON note(user, id, mtime, title);"
+        "CREATE INDEX note_user_mtime ON note(user, mtime, id, title);",
+
+        // 5: versions, for conditional GETs. Every change to a user's notes
+        // increments user.notes_version, which the note changed gets as its
+        // version: versions are unique per user, even if a deleted note's
+        // ID is reused. The index answers version checks without reading
+        // the note.
+        "ALTER TABLE user ADD COLUMN notes_version INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE note ADD COLUMN version INTEGER NOT NULL DEFAULT 0;"
+        "CREATE INDEX note_id_version ON note(id, user, version);"
+        "CREATE TRIGGER note_version_insert AFTER INSERT ON note BEGIN"
+        "    UPDATE user SET notes_version = notes_version + 1"
+        "        WHERE name = new.user;"
+        "    UPDATE note SET version = coalesce((SELECT notes_version FROM user"
+        "        WHERE name = new.user), 0) WHERE id = new.id;"
+        "END;"
+        "CREATE TRIGGER note_version_update AFTER UPDATE OF title, content "
+        "ON note BEGIN"
+        "    UPDATE user SET notes_version = notes_version + 1"
+        "        WHERE name = new.user;"
+        "    UPDATE note SET version = coalesce((SELECT notes_version FROM user"
+        "        WHERE name = new.user), 0) WHERE id = new.id;"
+        "END;"
+        "CREATE TRIGGER note_version_delete AFTER DELETE ON note BEGIN"
+        "    UPDATE user SET notes_version = notes_version + 1"
+        "        WHERE name = old.user;"
+        "END;",
+
+        // 6: delta sync. The notes versions (5) are the change sequence of
+        // each user; deleted notes leave a tombstone with the version of
+        // their deletion.
+        "CREATE TABLE note_tombstone("
+        "    user         TEXT NOT NULL,"
+        "    version      INTEGER NOT NULL,"
+        "    id           INTEGER NOT NULL,"
+        "    PRIMARY KEY(user, version)) WITHOUT ROWID;"
+        "CREATE INDEX note_user_version ON note(user, version);"
+        "DROP TRIGGER note_version_delete;"
+        "CREATE TRIGGER note_version_delete AFTER DELETE ON note BEGIN"
+        "    UPDATE user SET notes_version = notes_version + 1"
+        "        WHERE name = old.user;"
+        "    INSERT OR REPLACE INTO note_tombstone(user, version, id)"
+        "        VALUES(old.user, coalesce((SELECT notes_version FROM user"
+        "            WHERE name = old.user), 0), old.id);"
+        "END;",
+
+        // 7: Merkle trees of the notes (see DB::get_merkle_node). The
+        // digests of existing notes, and their trees, are computed by
+        // DB::fill_note_digests().
+        "ALTER TABLE note ADD COLUMN digest TEXT;"
+        "CREATE INDEX note_user_digest ON note(user, id, digest);"
+        "CREATE TABLE merkle("
+        "    user         TEXT NOT NULL,"
+        "    level        INTEGER NOT NULL,"
+        "    idx          INTEGER NOT NULL,"
+        "    hash         TEXT NOT NULL,"
+        "    PRIMARY KEY(user, level, idx)) WITHOUT ROWID;",
+
+        // 8: revision history of the notes (see DB::add_revision). The
+        // data is the content for snapshots (depth 0), else the delta
+        // from the previous revision.
+        "CREATE TABLE note_revision("
+        "    note         INTEGER NOT NULL,"
+        "    version      INTEGER NOT NULL,"
+        "    mtime        INTEGER NOT NULL,"
+        "    title        TEXT NOT NULL,"
+        "    size         INTEGER NOT NULL,"
+        "    depth        INTEGER NOT NULL,"
+        "    data         BLOB NOT NULL,"
+        "    PRIMARY KEY(note, version));"
+        "CREATE TRIGGER note_revision_delete AFTER DELETE ON note BEGIN"
+        "    DELETE FROM note_revision WHERE note = old.id;"
+        "END;",
+        };
+        return m;
+    }
 }
 
-DB::DB(const string& path)
+DB::DB(const string& path) : log_writer_(NULL), session_cache_(NULL)
 {
     db_.open(path);
-    db_.exec(
-    "CREATE TABLE IF  NOT EXISTS note("
-    "    id           INTEGER PRIMARY KEY,"
-    "    user         TEXT NOT NULL,"
-    "    title        TEXT NOT NULL DEFAULT '',"
-    "    content      TEXT NOT NULL DEFAULT '',"
-    "    FOREIGN KEY(user) REFERENCES user(name) ON DELETE CASCADE);"
-    "CREATE TABLE IF  NOT EXISTS session("
-    "    id           INTEGER PRIMARY KEY,"
-    "    user         TEXT NOT NULL,"
-    "    auth         INTEGER NOT NULL DEFAULT 0,"
-    "    create_time  INTEGER NOT NULL DEFAULT (strftime('%s', 'now')));"
-    "CREATE TABLE IF  NOT EXISTS user("
-    "    name         TEXT PRIMARY KEY,"
-    "    pwd_hash     TEXT NOT NULL DEFAULT '',"
-    "    salt         TEXT NOT NULL DEFAULT (RANDOM()));",
-    0, 0, 0);
-    string log_def(
-    "CREATE TABLE IF NOT EXISTS log("
-    "    id           INTEGER PRIMARY KEY,"
-    "    time         INTEGER NOT NULL DEFAULT (strftime('%s', 'now')),");
-    foreach_(const string& s, log_env_vars) log_def += fmt("%1% TEXT,", s);
-    *log_def.rbegin() = ')';
-    log_def += ";";
-    db_.exec(log_def, 0, 0, 0);
+
+    // Other processes (CGI, or server processes sharing a port) may hold the
+    // write lock: wait for it instead of failing right away
+    db_.busy_timeout(5000);
+
+    // An up-to-date database needs no DDL at all
+    if (schema_version() != int64_t(migrations().size())) migrate();
+}
+
+void DB::fill_note_digests()
+{
+    const size_t batch_size = 256;
+
+    // The notes are hashed in batches, with their users' trees rebuilt
+    // afterwards
+    vector<string> users;
+    db_.for_each_row<string>("SELECT DISTINCT user FROM note "
+                             "WHERE digest IS NULL",
+                             [&users](string user)
+                             {
+                                 users.push_back(move(user));
+                             });
+    if (users.empty()) return;
+    for (;;)
+    {
+        vector<int64_t> ids;
+        vector<string> notes;
+        db_.for_each_row<int64_t, string_view, string_view>(
+            "SELECT id, title, content FROM note WHERE digest IS NULL "
+            "LIMIT ?",
+            [&](int64_t id, string_view title, string_view content)
+            {
+                ids.push_back(id);
+                notes.push_back(string(title) + '\0' + string(content));
+            },
+            int64_t(batch_size));
+        if (ids.empty()) break;
+
+        vector<string_view> views(notes.begin(), notes.end());
+        auto digests = Sha1Batch::hash(views);
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            const auto& d = digests[i];
+            db_.execute("UPDATE note SET digest=? WHERE id=?",
+                        fmt("%08x%08x%08x%08x%08x", d[0], d[1], d[2], d[3],
+                            d[4]),
+                        ids[i]);
+        }
+    }
+    foreach_(const string& user, users) rebuild_merkle(user);
+}
+
+void DB::rebuild_merkle(string_view user)
+{
+    db_.execute("DELETE FROM merkle WHERE user=?", user);
+
+    // Each level is built from the one below, whose items are listed in
+    // order, by grouping them by parent
+    int64_t parent = -1;
+    string  lines;
+    auto flush = [&](int level)
+    {
+        if (parent >= 0)
+        {
+            db_.execute("INSERT INTO merkle(user, level, idx, hash) "
+                        "VALUES(?, ?, ?, ?)",
+                        user, level, parent, merkle_hash(lines));
+        }
+        parent = -1;
+        lines.clear();
+    };
+    auto add = [&](int level, int64_t idx, int bits, string_view hash)
+    {
+        if (idx >> bits != parent) flush(level);
+        parent = idx >> bits;
+        fmt_to(lines, "%1%:%2%\n", idx, hash);
+    };
+
+    db_.for_each_row<int64_t, string_view>(
+        "SELECT id, digest FROM note WHERE user=? ORDER BY id",
+        [&](int64_t id, string_view digest)
+        {
+            add(0, id, merkle_leaf_bits, digest);
+        },
+        user);
+    flush(0);
+    for (int level = 1; level <= merkle_top_level; ++level)
+    {
+        // Read before the new level is written
+        vector<pair<int64_t, string>> children;
+        db_.for_each_row<int64_t, string>(
+            "SELECT idx, hash FROM merkle WHERE user=? AND level=? "
+            "ORDER BY idx",
+            [&children](int64_t idx, string hash)
+            {
+                children.emplace_back(idx, move(hash));
+            },
+            user, level - 1);
+        foreach_(const auto& c, children)
+        {
+            add(level, c.first, merkle_fanout_bits, c.second);
+        }
+        flush(level);
+    }
+}
+
+void DB::update_merkle(string_view user, int64_t id)
+{
+    int64_t idx = id >> merkle_leaf_bits;
+    string  lines;
+    db_.for_each_row<int64_t, string_view>(
+        "SELECT id, digest FROM note WHERE user=? AND id >= ? AND id < ? "
+        "ORDER BY id",
+        [&lines](int64_t id, string_view digest)
+        {
+            fmt_to(lines, "%1%:%2%\n", id, digest);
+        },
+        user, idx << merkle_leaf_bits, (idx + 1) << merkle_leaf_bits);
+
+    for (int level = 0;;)
+    {
+        // Empty nodes are not stored
+        string hash = merkle_hash(lines);
+        if (hash.empty())
+        {
+            db_.execute("DELETE FROM merkle WHERE user=? AND level=? "
+                        "AND idx=?", user, level, idx);
+        }
+        else
+        {
+            db_.execute("INSERT OR REPLACE INTO merkle(user, level, idx, "
+                        "hash) VALUES(?, ?, ?, ?)", user, level, idx, hash);
+        }
+        if (++level > merkle_top_level) break;
+
+        idx >>= merkle_fanout_bits;
+        lines.clear();
+        get_merkle_children(user, level, idx,
+                            [&lines](int64_t child, string_view hash)
+        {
+            fmt_to(lines, "%1%:%2%\n", child, hash);
+        });
+    }
+}
+
+int64_t DB::schema_version()
+{
+    return get<0>(*db_.query<int64_t>("PRAGMA user_version").first());
+}
+
+void DB::migrate()
+{
+    // Let readers on other connections proceed while a write is in progress.
+    // The journal mode is persistent, and can't be changed in a transaction.
+    db_.exec("PRAGMA journal_mode=WAL", 0, 0, 0);
+
+    // Other processes may be migrating too: take the write lock before
+    // reading the version
+    db_.exec("BEGIN IMMEDIATE", 0, 0, 0);
+    try
+    {
+        int64_t latest  = migrations().size();
+        int64_t version = schema_version();
+        CHECK(version <= latest, "Database schema version %1% is newer than "
+              "the latest known version (%2%)", version, latest);
+        if (version == latest)
+        {
+            db_.exec("COMMIT", 0, 0, 0);
+            return;
+        }
+        for (; version < latest; ++version)
+        {
+            db_.exec(migrations()[version], 0, 0, 0);
+        }
+        fill_note_digests();
+        db_.exec(fmt("PRAGMA user_version=%1%", latest), 0, 0, 0);
+        db_.exec("COMMIT", 0, 0, 0);
+    }
+    catch (...)
+    {
+        db_.exec("ROLLBACK", 0, 0, 0);
+        throw;
+    }
 }
 
 void DB::exec(const std::string& sql)
@@ -72,105 +486,521 @@ void DB::exec(const std::string& sql)
     db_.exec(sql, NULL, NULL, NULL);
 }
 
-shared_ptr<Session> DB::get_session(const string& sid_str)
+optional<Session> DB::get_session(string_view sid_str)
 {
-    shared_ptr<Session> s;
-    auto stmt = db_.prepare_v2(
-        fmt("SELECT user, auth, (strftime('%%s', 'now') - create_time) "
-            "as age FROM session WHERE id='%s'", sid_str), -1, 0);
-    if (stmt->step() == SQLITE_ROW)
+    if (session_cache_)
     {
-        s.reset(new Session);
-        s->user = stmt->column_text(0);
-        s->auth = stmt->column_int(1);
-        s->age  = stmt->column_int(2);
+        if (auto ses = session_cache_->get(sid_str)) return ses;
     }
+
+    auto row = db_.query<string, int64_t, int64_t>(
+        "SELECT user, auth, (strftime('%s', 'now') - create_time) "
+        "as age FROM session WHERE id=? AND age < ?",
+        sid_str, max_session_age).first();
+    if (!row) return nullopt;
+    Session s;
+    tie(s.user, s.auth, s.age) = *row;
+    if (session_cache_) session_cache_->put(sid_str, s);
     return s;
 }
 
-void DB::insert_session(const string& sid_str, const string& user)
+void DB::insert_session(string_view sid_str, string_view user)
 {
-    exec(fmt("INSERT INTO session(id, user) VALUES(%1%, '%2%')",
-             sid_str, user));
+    db_.execute("INSERT INTO session(id, user) VALUES(?, ?)", sid_str, user);
+    if (session_cache_)
+    {
+        Session s;
+        s.user = user;
+        s.auth = 0;
+        s.age  = 0;
+        session_cache_->put(sid_str, s);
+    }
 }
 
-void DB::delete_session(const std::string& sid_str)
+void DB::set_session_auth(string_view sid_str)
 {
-    exec(fmt("DELETE FROM session WHERE id=%1%", sid_str));
+    db_.execute("UPDATE session SET auth=1 WHERE id=?", sid_str);
+    if (session_cache_) session_cache_->set_auth(sid_str);
 }
 
-shared_ptr<User> DB::get_user(const string& name)
+void DB::delete_session(string_view sid_str)
 {
-    shared_ptr<User> u;
-    auto stmt = db_.prepare_v2(
-        fmt("SELECT pwd_hash, salt FROM user WHERE name='%1%'", name), -1, 0);
-    if (stmt->step() == SQLITE_ROW)
-    {
-        u.reset(new User);
-        u->pwd_hash = stmt->column_text(0);
-        u->salt     = stmt->column_text(1);
-    }
+    db_.execute("DELETE FROM session WHERE id=?", sid_str);
+    if (session_cache_) session_cache_->erase(sid_str);
+}
+
+optional<User> DB::get_user(string_view name)
+{
+    auto row = db_.query<string, string>(
+        "SELECT pwd_hash, salt FROM user WHERE name=?", name).first();
+    if (!row) return nullopt;
+    User u;
+    u.name = name;
+    tie(u.pwd_hash, u.salt) = move(*row);
     return u;
 }
 
-shared_ptr<User> DB::insert_user(const string& name)
+optional<User> DB::insert_user(string_view name)
 {
-    exec(fmt("INSERT INTO user(name) VALUES('%1%')", name));
+    db_.execute("INSERT INTO user(name) VALUES(?)", name);
     return get_user(name);
 }
 
-void DB::set_user_pwd_hash(const string& name, const string& phash)
+void DB::set_user_pwd_hash(string_view name, string_view phash)
+{
+    db_.execute("UPDATE user SET pwd_hash=? WHERE name=?", phash, name);
+}
+
+void DB::log(const Env& env)
+{
+    LogRecord rec(log_env_vars.size());
+    for (size_t i = 0; i < log_env_vars.size(); ++i)
+    {
+        auto value = env.find(log_env_vars[i]);
+        if (value) rec[i] = string(*value);
+    }
+    if (log_writer_) log_writer_->push(move(rec));
+    else             insert_log(rec);
+}
+
+void DB::insert_log(const LogRecord& rec)
+{
+    auto stmt = db_.prepare(log_insert);
+    for (size_t i = 0; i < rec.size(); ++i)
+    {
+        if (rec[i]) stmt->bind_text(i + 1, *rec[i], false);
+    }
+    stmt->step();
+}
+
+void DB::get_note_list(string_view user, NoteOrder order,
+                       const std::optional<NoteKey>& after, int64_t limit,
+                       const function<void(int64_t, int64_t,
+                                           string_view)>& f)
 {
-    exec(fmt("UPDATE user SET pwd_hash='%1%' WHERE name='%2%'", phash, name));
+    if (order == NoteOrder::ID)
+    {
+        db_.for_each_row<int64_t, int64_t, string_view>(
+            "SELECT id, mtime, title FROM note WHERE user=? AND id > ? "
+            "ORDER BY id LIMIT ?",
+            f, user, after ? after->id : 0, limit);
+    }
+    else if (!after)
+    {
+        db_.for_each_row<int64_t, int64_t, string_view>(
+            "SELECT id, mtime, title FROM note WHERE user=? "
+            "ORDER BY mtime DESC, id DESC LIMIT ?",
+            f, user, limit);
+    }
+    else
+    {
+        db_.for_each_row<int64_t, int64_t, string_view>(
+            "SELECT id, mtime, title FROM note "
+            "WHERE user=? AND mtime <= ? AND (mtime < ? OR id < ?) "
+            "ORDER BY mtime DESC, id DESC LIMIT ?",
+            f, user, after->mtime, after->mtime, after->id, limit);
+    }
 }
 
-void DB::log(const map<string, string>& env)
+bool DB::get_note(string_view id, string_view user, int64_t max_content,
+                  const function<void(string_view, string_view, int64_t,
+                                      int64_t)>& f)
 {
-    string sql("INSERT INTO log(");
-    foreach_(const string& s, log_env_vars)
+    auto note = open_note_content(id, user);
+    if (!note) return false;
+    int64_t size = note->blob->size();
+    string  content;
+    if (size <= max_content)
     {
-        if (env.find(s) != env.end()) sql += fmt("%1%,", s);
+        content.resize(size);
+        note->blob->read(&content[0], size, 0);
     }
-    *sql.rbegin() = ')';
-    sql += " VALUES(";
-    foreach_(const string& s, log_env_vars)
+    db_.for_each_row<string_view>(
+        "SELECT title FROM note WHERE id=?",
+        [&](string_view title)
+        {
+            f(title, content, note->version, size);
+        },
+        id);
+    return true;
+}
+
+optional<NoteContent> DB::open_note_content(string_view id,
+                                            string_view user)
+{
+    // The blob is opened first, so that the version is read in its
+    // snapshot
+    NoteContent note;
+    note.blob = db_.open_blob("note", "content", parse_note_id(id));
+    if (!note.blob) return nullopt;
+    auto version = get_note_version(id, user);
+    if (!version) return nullopt;
+    note.version = *version;
+    return note;
+}
+
+optional<int64_t> DB::get_note_version(string_view id, string_view user)
+{
+    auto row = db_.query<int64_t>(
+        "SELECT version FROM note WHERE id=? AND user=?", id, user).first();
+    if (!row) return nullopt;
+    return get<0>(*row);
+}
+
+int64_t DB::get_notes_version(string_view user)
+{
+    auto row = db_.query<int64_t>(
+        "SELECT notes_version FROM user WHERE name=?", user).first();
+    return row ? get<0>(*row) : 0;
+}
+
+bool DB::get_changes(string_view user, int64_t since, int64_t limit,
+                     int64_t max_content, int64_t max_total,
+                     const function<void(int64_t, int64_t, bool, string_view,
+                                         string_view, int64_t)>& f)
+{
+    // The contents are read through blobs, in the snapshot of the query,
+    // so that the large ones are only measured
+    int64_t count = 0;
+    int64_t total = 0;
+    bool    full  = false;
+    string  content;
+    db_.for_each_row<int64_t, int64_t, int, string_view>(
+        "SELECT version, id, 0, title FROM note "
+        "WHERE user=? AND version > ? "
+        "UNION ALL "
+        "SELECT version, id, 1, '' FROM note_tombstone "
+        "WHERE user=? AND version > ? "
+        "ORDER BY version LIMIT ?",
+        [&](int64_t version, int64_t id, int deleted, string_view title)
+        {
+            if (full) return;
+            int64_t size = 0;
+            content.clear();
+            if (!deleted)
+            {
+                auto blob = db_.open_blob("note", "content", id);
+                CHECK(blob, "Can't read the content of note %1%", id);
+                size = blob->size();
+                if (size <= max_content)
+                {
+                    if (count && total + size > max_total)
+                    {
+                        full = true;
+                        return;
+                    }
+                    total += size;
+                    content.resize(size);
+                    blob->read(&content[0], size, 0);
+                }
+            }
+            ++count;
+            f(version, id, deleted, title, content, size);
+        },
+        user, since, user, since, limit);
+    return full;
+}
+
+void DB::search_notes(string_view user, string_view search, int64_t limit,
+                      int64_t offset,
+                      const function<void(int64_t, string_view,
+                                          string_view)>& f)
+{
+    string q = fts_query(search);
+    if (q.empty()) return;
+
+    // Titles weigh 10 times more than the content in the ranking
+    db_.for_each_row<int64_t, string_view, string_view>(
+        "SELECT note.id, note.title,"
+        "       snippet(note_fts, -1, char(2), char(3), '...', 16) "
+        "FROM note_fts JOIN note ON note.id = note_fts.rowid "
+        "WHERE note_fts MATCH ? AND note.user = ? "
+        "ORDER BY bm25(note_fts, 10.0, 1.0) LIMIT ? OFFSET ?",
+        f, q, user, limit, offset);
+}
+
+int64_t DB::insert_note(string_view user)
+{
+    int64_t id;
+    transaction([&]
+    {
+        db_.execute("INSERT INTO note(user, mtime, digest) "
+                    "VALUES(?, strftime('%s', 'now'), ?)",
+                    user, note_digest("", ""));
+        id = db_.last_rowid();
+        update_merkle(user, id);
+    });
+    return id;
+}
+
+bool DB::delete_note(string_view id, string_view user)
+{
+    bool deleted = false;
+    transaction([&]
+    {
+        db_.execute("DELETE FROM note WHERE id=? AND user=?", id, user);
+        deleted = db_.changes() > 0;
+        if (deleted) update_merkle(user, parse_note_id(id));
+    });
+    return deleted;
+}
+
+void DB::update_note(string_view id, string_view user,
+                     string_view title, string_view content)
+{
+    transaction([&]
+    {
+        auto old = get_note_state(id, user);
+        if (old) write_note(*old, user, title, content);
+    });
+}
+
+PatchResult DB::patch_note(string_view id, string_view user, int64_t base,
+                           optional<string_view> title,
+                           const vector<Splice>& splices, int64_t& version)
+{
+    PatchResult result = PatchResult::NOT_FOUND;
+    transaction([&]
     {
-        auto it = env.find(s);
-        if (it != env.end()) sql += fmt("'%1%',", it->second);
+        auto old = get_note_state(id, user);
+        if (!old) return;
+        version = old->version;
+        if (version != base)
+        {
+            result = PatchResult::CONFLICT;
+            return;
+        }
+
+        string content = old->content;
+        foreach_(const Splice& s, splices)
+        {
+            int64_t size = content.size();
+            if (s.offset > size || s.length > size - s.offset)
+            {
+                result = PatchResult::INVALID;
+                return;
+            }
+            content.replace(s.offset, s.length, s.text);
+        }
+        write_note(*old, user, title ? *title : old->title, content);
+        version = *get_note_version(id, user);
+        result  = PatchResult::OK;
+    });
+    return result;
+}
+
+void DB::get_revisions(string_view id, string_view user, int64_t before,
+                       int64_t limit,
+                       const function<void(int64_t, int64_t, int64_t,
+                                           string_view)>& f)
+{
+    db_.for_each_row<int64_t, int64_t, int64_t, string_view>(
+        "SELECT r.version, r.mtime, r.size, r.title FROM note_revision r "
+        "JOIN note n ON n.id = r.note "
+        "WHERE r.note=? AND n.user=? AND r.version < ? "
+        "ORDER BY r.version DESC LIMIT ?",
+        f, id, user, before, limit);
+}
+
+bool DB::get_revision(string_view id, string_view user, int64_t version,
+                      const function<void(string_view, string_view,
+                                          int64_t)>& f)
+{
+    auto row = db_.query<string, int64_t, int64_t>(
+        "SELECT r.title, r.mtime, r.depth FROM note_revision r "
+        "JOIN note n ON n.id = r.note "
+        "WHERE r.note=? AND n.user=? AND r.version=?",
+        id, user, version).first();
+    if (!row) return false;
+    auto& [title, mtime, depth] = *row;
+
+    // The revision is rebuilt from the last snapshot, with the deltas of
+    // the revisions in between
+    vector<pair<int64_t, string>> chain;
+    db_.for_each_row<int64_t, string>(
+        "SELECT depth, data FROM note_revision WHERE note=? AND version <= ? "
+        "ORDER BY version DESC LIMIT ?",
+        [&chain](int64_t depth, string data)
+        {
+            chain.emplace_back(depth, move(data));
+        },
+        id, version, depth + 1);
+    CHECK(!chain.empty() && chain.back().first == 0,
+          "Revision %1% of note %2% has no snapshot", version, id);
+    string content = move(chain.back().second);
+    for (size_t i = chain.size() - 1; i-- > 0;)
+    {
+        content = Delta::apply(content, chain[i].second);
+    }
+    f(title, content, mtime);
+    return true;
+}
+
+RestoreResult DB::restore_revision(string_view id, string_view user,
+                                   int64_t revision, int64_t& version)
+{
+    RestoreResult result = RestoreResult::NOT_FOUND;
+    transaction([&]
+    {
+        auto old = get_note_state(id, user);
+        if (!old) return;
+        string title;
+        string content;
+        auto copy = [&](string_view t, string_view text, int64_t)
+        {
+            title   = t;
+            content = text;
+        };
+        if (!get_revision(id, user, revision, copy))
+        {
+            result = RestoreResult::NO_REVISION;
+            return;
+        }
+        write_note(*old, user, title, content);
+        version = *get_note_version(id, user);
+        result  = RestoreResult::OK;
+    });
+    return result;
+}
+
+optional<DB::NoteState> DB::get_note_state(string_view id, string_view user)
+{
+    auto row = db_.query<int64_t, int64_t, int64_t, string, string>(
+        "SELECT id, version, mtime, title, content FROM note "
+        "WHERE id=? AND user=?", id, user).first();
+    if (!row) return nullopt;
+    auto& [note_id, version, mtime, title, content] = *row;
+    return NoteState{note_id, version, mtime, move(title), move(content)};
+}
+
+void DB::write_note(const NoteState& old, string_view user,
+                    string_view title, string_view content)
+{
+    db_.execute("UPDATE note SET title=?, content=?, digest=?, "
+                "mtime=strftime('%s', 'now') WHERE id=?",
+                title, content, note_digest(title, content), old.id);
+    update_merkle(user, old.id);
+    add_revision(old, title, content);
+}
+
+void DB::add_revision(const NoteState& old, string_view title,
+                      string_view content)
+{
+    if (title == old.title && content == old.content) return;
+
+    // The history starts with the state of the note before its first
+    // update (notes are created empty, and notes older than the history
+    // have none)
+    auto prev = db_.query<int64_t>(
+        "SELECT depth FROM note_revision WHERE note=? "
+        "ORDER BY version DESC LIMIT 1", old.id).first();
+    if (!prev)
+    {
+        insert_revision(old.id, old.version, old.mtime, old.title,
+                        old.content.size(), 0, old.content);
+    }
+    int64_t depth = prev ? get<0>(*prev) + 1 : 1;
+
+    // A delta no smaller than the content is not worth a link in the chain
+    string data;
+    if (depth <= max_revision_chain())
+    {
+        data = Delta::create(old.content, content);
+    }
+    if (depth > max_revision_chain() || data.size() >= content.size())
+    {
+        depth = 0;
+        data  = content;
     }
-    *sql.rbegin() = ')';
-    db_.exec(sql, 0, 0, 0);
+    auto row = db_.query<int64_t, int64_t>(
+        "SELECT version, mtime FROM note WHERE id=?", old.id).first();
+    insert_revision(old.id, get<0>(*row), get<1>(*row), title,
+                    content.size(), depth, data);
+}
+
+void DB::insert_revision(int64_t note, int64_t version, int64_t mtime,
+                         string_view title, int64_t size, int64_t depth,
+                         string_view data)
+{
+    db_.execute("INSERT INTO note_revision(note, version, mtime, title, "
+                "size, depth, data) VALUES(?, ?, ?, ?, ?, ?, "
+                "CAST(? AS BLOB))",
+                note, version, mtime, title, size, depth, data);
 }
 
-vector<NoteDesc> DB::get_note_list(const string& user)
+bool DB::get_merkle_node(string_view user, int level, int64_t idx,
+                         string& hash)
 {
-    vector<NoteDesc> v;
-    auto stmt = db_.prepare_v2(
-        fmt("SELECT id,title FROM note WHERE user='%1%'", user), -1, 0);
-    while (stmt->step() == SQLITE_ROW)
+    // Level l has 16^(top - l) nodes; larger indexes would overflow the
+    // ID ranges of the children
+    if (level < 0 || level > merkle_top_level || idx < 0 ||
+        idx >= int64_t(1) << merkle_fanout_bits * (merkle_top_level - level))
     {
-        NoteDesc nd;
-        nd.id    = stmt->column_int(0);
-        nd.title = stmt->column_text(1);
-        v.push_back(nd);
+        return false;
     }
-    return v;
+    auto row = db_.query<string>(
+        "SELECT hash FROM merkle WHERE user=? AND level=? AND idx=?",
+        user, level, idx).first();
+    hash = row ? get<0>(*row) : "";
+    return true;
 }
 
-shared_ptr<Note> DB::get_note(const string& id)
+void DB::get_merkle_children(string_view user, int level, int64_t idx,
+                             const function<void(int64_t,
+                                                 string_view)>& f)
 {
-    shared_ptr<Note> n;
-    auto stmt = db_.prepare_v2(
-        fmt("SELECT title,content FROM note WHERE id=%1%", id), -1, 0);
-    if (stmt->step() == SQLITE_ROW)
+    if (level == 0)
     {
-        n.reset(new Note);
-        n->title_   = stmt->column_text(0);
-        n->content_ = stmt->column_text(1);
+        db_.for_each_row<int64_t, string_view>(
+            "SELECT id, digest FROM note WHERE user=? AND id >= ? AND id < ? "
+            "ORDER BY id",
+            f, user, idx << merkle_leaf_bits, (idx + 1) << merkle_leaf_bits);
+        return;
     }
+    db_.for_each_row<int64_t, string_view>(
+        "SELECT idx, hash FROM merkle WHERE user=? AND level=? AND idx >= ? "
+        "AND idx < ? ORDER BY idx",
+        f, user, level - 1, idx << merkle_fanout_bits,
+        (idx + 1) << merkle_fanout_bits);
+}
+
+int DB::merkle_top()
+{
+    return merkle_top_level;
+}
+
+int64_t DB::parse_note_id(string_view id)
+{
+    int64_t n = 0;
+    from_chars(id.data(), id.data() + id.size(), n);
     return n;
 }
 
+void DB::transaction(const function<void()>& f)
+{
+    db_.exec("BEGIN IMMEDIATE", 0, 0, 0);
+    try
+    {
+        f();
+        db_.exec("COMMIT", 0, 0, 0);
+    }
+    catch (...)
+    {
+        db_.exec("ROLLBACK", 0, 0, 0);
+        throw;
+    }
+}
+
+string DB::get_secret(const string& name)
+{
+    db_.execute("INSERT OR IGNORE INTO secret(name, value) "
+                "VALUES(?, hex(randomblob(32)))", name);
+    auto row = db_.query<string>("SELECT value FROM secret WHERE name=?",
+                                 name).first();
+    CHECK(row, "Secret %1% not found", name);
+    return get<0>(*row);
+}
+
 int64_t DB::random_int64()
 {
     return db_.random_int64();
@@ -1,20 +1,29 @@
 #ifndef DB_H
 #define DB_H
 
+#include "params.h"
 #include "sqlite_wrapper.h"
 
 #include <cstdint>
-#include <map>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+class LogWriter;
+class SessionCache;
+
+// Sessions expire this long (in seconds) after being created
+const long max_session_age = 7 * 24 * 3600;
+
 class Session
 {
 public:
     std::string user;
-    long        auth;
-    long        age;
+    int64_t     auth;
+    int64_t     age;
 };
 
 class User
@@ -25,20 +34,59 @@ public:
     std::string salt;
 };
 
-class NoteDesc
+// Orders of the note list: by ID, or most recently modified first
+enum class NoteOrder
+{
+    ID,
+    MTIME
+};
+
+// Position in the note list: the sort key of the last note listed (mtime
+// is only used when ordering by modification time)
+class NoteKey
 {
 public:
-    int64_t     id;
-    std::string title;
+    int64_t mtime;
+    int64_t id;
 };
 
-class Note
+// Edit of a note's content: the length bytes at offset are replaced by text
+class Splice
 {
 public:
-    std::string title_;
-    std::string content_;
+    int64_t          offset;
+    int64_t          length;
+    std::string_view text;
 };
 
+// Outcome of DB::patch_note
+enum class PatchResult
+{
+    OK,
+    NOT_FOUND, // no such note for the user
+    CONFLICT,  // the note has changed since the base version
+    INVALID    // a splice is out of the content's bounds
+};
+
+// Content of a note, read in place (see DB::open_note_content)
+class NoteContent
+{
+public:
+    int64_t                       version;
+    std::unique_ptr<Sqlite::Blob> blob;
+};
+
+// Outcome of DB::restore_revision
+enum class RestoreResult
+{
+    OK,
+    NOT_FOUND,  // no such note for the user
+    NO_REVISION // no such revision of the note
+};
+
+// Values of the logged CGI variables, in column order (unset ones are NULL)
+typedef std::vector<std::optional<std::string>> LogRecord;
+
 class DB
 {
 public:
@@ -46,21 +94,208 @@ public:
 
     void exec(const std::string& sql);
 
-    std::shared_ptr<Session> get_session(const std::string& sid_str);
-    void insert_session(const std::string& sid_str,
-                        const std::string& user);
-    void delete_session(const std::string& sid_str);
-    std::shared_ptr<User> get_user(const std::string& name);
-    std::shared_ptr<User> insert_user(const std::string& name);
-    void set_user_pwd_hash(const std::string& name, const std::string& phash);
-    void log(const std::map<std::string, std::string>& env);
+    // Sessions are read from and written through to the session cache, if
+    // one is set (it must outlive this object)
+    void set_session_cache(SessionCache* cache) { session_cache_ = cache; }
+    std::optional<Session> get_session(std::string_view sid_str);
+    void insert_session(std::string_view sid_str, std::string_view user);
+    void set_session_auth(std::string_view sid_str);
+    void delete_session(std::string_view sid_str);
+    std::optional<User> get_user(std::string_view name);
+    std::optional<User> insert_user(std::string_view name);
+    void set_user_pwd_hash(std::string_view name, std::string_view phash);
+
+    // Logs the request, through the log writer if one is set (it must
+    // outlive this object), otherwise synchronously
+    void log(const Env& env);
+    void set_log_writer(LogWriter* log_writer) { log_writer_ = log_writer; }
+    void insert_log(const LogRecord& rec);
+
+    // Calls f(id, mtime, title) for at most "limit" notes of the user, in
+    // the given order, starting after the given note, if any. The title is
+    // read in place and only valid during the call.
+    void get_note_list(std::string_view user, NoteOrder order,
+                       const std::optional<NoteKey>& after, int64_t limit,
+                       const std::function<void(int64_t id, int64_t mtime,
+                                                std::string_view title)>& f);
+
+    // Calls f(title, content, version, size) if the note exists and
+    // belongs to the user; returns false otherwise. The content is only
+    // read if its size (in bytes) is at most max_content, and is empty
+    // otherwise. Both views are only valid during the call.
+    bool get_note(std::string_view id, std::string_view user,
+                  int64_t max_content,
+                  const std::function<void(std::string_view title,
+                                           std::string_view content,
+                                           int64_t version,
+                                           int64_t size)>& f);
+
+    // Opens the content of the note for incremental reads, if the note
+    // exists and belongs to the user. Until it is closed, reads are
+    // consistent with the version, and the connection must not write.
+    std::optional<NoteContent> open_note_content(std::string_view id,
+                                                 std::string_view user);
+
+    // Version of a note, changed by each update, without reading it
+    std::optional<int64_t> get_note_version(std::string_view id,
+                                            std::string_view user);
 
-    std::vector<NoteDesc> get_note_list(const std::string& user);
-    std::shared_ptr<Note> get_note(const std::string& id);
+    // Version of the user's notes, changed by each insert, update or
+    // delete
+    int64_t get_notes_version(std::string_view user);
+
+    // Calls f(version, id, deleted, title, content, size) for the changes
+    // to the user's notes made after the version "since" (see
+    // get_notes_version), at most "limit" of them, in version order.
+    // Created and updated notes come with their current title and content
+    // size, and their content if it is at most max_content bytes (empty
+    // otherwise); deleted ones come with empty strings. The changes stop
+    // before the contents read would exceed max_total bytes (after one at
+    // least), in which case true is returned. The views are only valid
+    // during the call.
+    bool get_changes(std::string_view user, int64_t since, int64_t limit,
+                     int64_t max_content, int64_t max_total,
+                     const std::function<void(int64_t version, int64_t id,
+                                              bool deleted,
+                                              std::string_view title,
+                                              std::string_view content,
+                                              int64_t size)>& f);
+
+    // Calls f(id, title, snippet) for the user's notes matching the search,
+    // best matches first (by bm25, titles weighing more than the content),
+    // skipping the first "offset" ones and returning at most "limit". Words
+    // ending with '*' match as prefixes. In the snippets, the matched words
+    // are delimited by '\x02' and '\x03', to be replaced by markup after
+    // escaping. The views are only valid during the call.
+    void search_notes(std::string_view user, std::string_view search,
+                      int64_t limit, int64_t offset,
+                      const std::function<void(int64_t id,
+                                               std::string_view title,
+                                               std::string_view snippet)>& f);
+
+    int64_t insert_note(std::string_view user);
+    // Returns false if the note does not exist or belongs to another user
+    bool delete_note(std::string_view id, std::string_view user);
+    void update_note(std::string_view id, std::string_view user,
+                     std::string_view title, std::string_view content);
+
+    // Applies the splices, in order (each to the result of the previous
+    // ones), to the content of the note, and replaces the title if one is
+    // given, provided the note is still at the base version. The note's
+    // version is returned in version, whatever the outcome (unless the
+    // note does not exist).
+    PatchResult patch_note(std::string_view id, std::string_view user,
+                           int64_t base,
+                           std::optional<std::string_view> title,
+                           const std::vector<Splice>& splices,
+                           int64_t& version);
+
+    // Revision history: each update of a note records its new state, as a
+    // revision numbered by the version it gave the note (the history
+    // starts with the state before the first update). Revisions are
+    // stored as deltas from the previous one, with a full snapshot after
+    // a bounded number of deltas (see max_revision_chain() in db.cpp).
+    // The history is deleted with the note.
+    //
+    // Calls f(version, mtime, size, title) for the revisions of the note
+    // older than before, newest first (at most limit of them)
+    void get_revisions(std::string_view id, std::string_view user,
+                       int64_t before, int64_t limit,
+                       const std::function<void(int64_t version,
+                                                int64_t mtime, int64_t size,
+                                                std::string_view title)>& f);
+
+    // Calls f(title, content, mtime) with a revision of the note; returns
+    // false if there is no such revision
+    bool get_revision(std::string_view id, std::string_view user,
+                      int64_t version,
+                      const std::function<void(std::string_view title,
+                                               std::string_view content,
+                                               int64_t mtime)>& f);
+
+    // Restores a revision of the note, as a new update. The new version of
+    // the note is returned in version.
+    RestoreResult restore_revision(std::string_view id,
+                                   std::string_view user, int64_t revision,
+                                   int64_t& version);
+
+    // Merkle tree of the user's notes, for set reconciliation. A leaf
+    // (level 0, index i) covers the notes with IDs 16i to 16i + 15, and
+    // node (level l, index i) the children (l - 1, 16i) to (l - 1,
+    // 16i + 15); the root is node (merkle_top(), 0). Hashes are
+    // hexadecimal SHA-1s:
+    //   - note digest: of the title, a NUL character and the content
+    //   - leaf hash: of the lines "<id>:<digest>\n" of its notes
+    //   - node hash: of the lines "<index>:<hash>\n" of its non-empty
+    //     children
+    // Both in index order; an empty subtree has an empty hash. The trees
+    // are updated with each change to the notes.
+    //
+    // Returns false if there is no such node; the hash is empty if the
+    // subtree is
+    bool get_merkle_node(std::string_view user, int level, int64_t idx,
+                         std::string& hash);
+
+    // Calls f(index, hash) for the non-empty children of a node, or
+    // f(id, digest) for the notes of a leaf. The node must exist (see
+    // get_merkle_node).
+    void get_merkle_children(std::string_view user, int level, int64_t idx,
+                             const std::function<void(int64_t idx,
+                                                      std::string_view hash)>&
+                                 f);
+    static int merkle_top();
+
+    // Returns the named secret, generating a random one on first use
+    std::string get_secret(const std::string& name);
 
     int64_t random_int64();
 
     Sqlite db_;
+
+private:
+    int64_t schema_version();
+
+    // Brings the schema up to date (see migrations() in db.cpp)
+    void migrate();
+
+    // Computes the missing note digests (of the notes created before the
+    // Merkle trees), and rebuilds the trees of their users
+    void fill_note_digests();
+    void rebuild_merkle(std::string_view user);
+
+    // Recomputes the path from the leaf of the note to the root
+    void update_merkle(std::string_view user, int64_t id);
+
+    // State of a note before an update
+    class NoteState
+    {
+    public:
+        int64_t     id;
+        int64_t     version;
+        int64_t     mtime;
+        std::string title;
+        std::string content;
+    };
+
+    std::optional<NoteState> get_note_state(std::string_view id,
+                                            std::string_view user);
+
+    // Updates the note, its Merkle tree path and its history
+    void write_note(const NoteState& old, std::string_view user,
+                    std::string_view title, std::string_view content);
+    void add_revision(const NoteState& old, std::string_view title,
+                      std::string_view content);
+    void insert_revision(int64_t note, int64_t version, int64_t mtime,
+                         std::string_view title, int64_t size,
+                         int64_t depth, std::string_view data);
+
+    static int64_t parse_note_id(std::string_view id);
+
+    // Runs f in a write transaction, rolled back if f throws
+    void transaction(const std::function<void()>& f);
+
+    LogWriter*    log_writer_;
+    SessionCache* session_cache_;
 };
 
 #endif
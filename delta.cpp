@@ -0,0 +1,162 @@
+#include "delta.h"
+#include "util.h"
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+using namespace std;
+
+namespace
+{
+    const size_t block = 16;
+
+    // Multiplier of the rolling hash, and its power for the byte that
+    // leaves the window
+    const uint64_t hash_mul = 0x100000001b3;
+    const uint64_t hash_out = []
+    {
+        uint64_t p = 1;
+        for (size_t i = 1; i < block; ++i) p *= hash_mul;
+        return p;
+    }();
+
+    uint64_t hash_block(const char* p)
+    {
+        uint64_t h = 0;
+        for (size_t i = 0; i < block; ++i)
+        {
+            h = h * hash_mul + static_cast<unsigned char>(p[i]);
+        }
+        return h;
+    }
+
+    void put_varint(string& out, uint64_t n)
+    {
+        for (; n >= 0x80; n >>= 7) out += char((n & 0x7f) | 0x80);
+        out += char(n);
+    }
+
+    uint64_t get_varint(string_view s, size_t& pos)
+    {
+        uint64_t n = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            CHECK(pos < s.size() && shift < 64, "Invalid delta");
+            unsigned char c = s[pos++];
+            n |= uint64_t(c & 0x7f) << shift;
+            if (c < 0x80) return n;
+        }
+    }
+
+    void put_insert(string& out, string_view s)
+    {
+        if (s.empty()) return;
+        put_varint(out, s.size() << 1);
+        out += s;
+    }
+
+    void put_copy(string& out, size_t offset, size_t n)
+    {
+        if (n == 0) return;
+        put_varint(out, n << 1 | 1);
+        put_varint(out, offset);
+    }
+}
+
+string Delta::create(string_view source, string_view target)
+{
+    string out;
+    put_varint(out, target.size());
+
+    size_t max_common = min(source.size(), target.size());
+    size_t prefix = 0;
+    while (prefix < max_common && source[prefix] == target[prefix]) ++prefix;
+    size_t suffix = 0;
+    while (suffix < max_common - prefix &&
+           source[source.size() - suffix - 1] ==
+           target[target.size() - suffix - 1])
+    {
+        ++suffix;
+    }
+    put_copy(out, 0, prefix);
+
+    // Only the middles are matched; source offsets are relative to src
+    string_view src = source.substr(prefix, source.size() - prefix - suffix);
+    string_view dst = target.substr(prefix, target.size() - prefix - suffix);
+    unordered_map<uint64_t, size_t> blocks;
+    for (size_t i = 0; i + block <= src.size(); i += block)
+    {
+        blocks.emplace(hash_block(src.data() + i), i);
+    }
+
+    size_t literal = 0; // Start of the bytes not written yet
+    size_t i       = 0;
+    uint64_t h     = 0;
+    if (!blocks.empty() && dst.size() >= block) h = hash_block(dst.data());
+    while (!blocks.empty() && i + block <= dst.size())
+    {
+        auto it = blocks.find(h);
+        if (it != blocks.end() &&
+            memcmp(src.data() + it->second, dst.data() + i, block) == 0)
+        {
+            // Extend the match both ways
+            size_t s = it->second;
+            size_t t = i;
+            while (t > literal && s > 0 && src[s - 1] == dst[t - 1])
+            {
+                --s;
+                --t;
+            }
+            size_t n = i - t + block;
+            while (s + n < src.size() && t + n < dst.size() &&
+                   src[s + n] == dst[t + n])
+            {
+                ++n;
+            }
+            put_insert(out, dst.substr(literal, t - literal));
+            put_copy(out, prefix + s, n);
+            i = literal = t + n;
+            if (i + block <= dst.size()) h = hash_block(dst.data() + i);
+            continue;
+        }
+        if (i + block < dst.size())
+        {
+            h = (h - static_cast<unsigned char>(dst[i]) * hash_out) *
+                    hash_mul +
+                static_cast<unsigned char>(dst[i + block]);
+        }
+        ++i;
+    }
+    put_insert(out, dst.substr(literal));
+    put_copy(out, source.size() - suffix, suffix);
+    return out;
+}
+
+string Delta::apply(string_view source, string_view delta)
+{
+    size_t pos  = 0;
+    size_t size = get_varint(delta, pos);
+    string target;
+    target.reserve(size);
+    while (pos < delta.size())
+    {
+        uint64_t op = get_varint(delta, pos);
+        uint64_t n  = op >> 1;
+        if (op & 1)
+        {
+            uint64_t offset = get_varint(delta, pos);
+            CHECK(offset <= source.size() && n <= source.size() - offset,
+                  "Invalid delta copy");
+            target.append(source.substr(offset, n));
+        }
+        else
+        {
+            CHECK(n <= delta.size() - pos, "Invalid delta insertion");
+            target.append(delta.substr(pos, n));
+            pos += n;
+        }
+    }
+    CHECK(target.size() == size, "Invalid delta size");
+    return target;
+}
@@ -0,0 +1,28 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <string>
+#include <string_view>
+
+// Binary deltas between two versions of a text: a delta rebuilds the target
+// from the source with copies of source ranges and literal insertions, so
+// that its size is about the number of bytes changed. The common prefix and
+// suffix are found first (a single edit costs nothing more); matches in the
+// rest are found with a rolling hash of 16-byte blocks of the source.
+//
+// Format: the target size, then the operations, all as varints. An
+// operation is either (n << 1), followed by n literal bytes, or
+// (n << 1 | 1) and an offset, copying n bytes of the source from offset.
+class Delta
+{
+public:
+    // Returns the delta turning source into target
+    static std::string create(std::string_view source,
+                              std::string_view target);
+
+    // Returns the target rebuilt from the source and delta; throws if the
+    // delta is invalid for this source
+    static std::string apply(std::string_view source, std::string_view delta);
+};
+
+#endif
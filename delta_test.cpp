@@ -0,0 +1,170 @@
+// Tests of the binary deltas of the revision history: prints the failed
+// checks, and exits with a non-zero status if there are any.
+
+#include "delta.h"
+
+#include <exception>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+namespace
+{
+    int failures = 0;
+
+    void expect(bool cond, const string& what)
+    {
+        if (cond) return;
+        cout << "FAILED: " << what << endl;
+        ++failures;
+    }
+
+    // Checks that the delta from source to target rebuilds the target, and
+    // returns its size
+    size_t round_trip(const string& source, const string& target,
+                      const string& what)
+    {
+        string delta = Delta::create(source, target);
+        string rebuilt;
+        try
+        {
+            rebuilt = Delta::apply(source, delta);
+        }
+        catch (const std::exception& ex)
+        {
+            expect(false, what + ": " + ex.what());
+            return delta.size();
+        }
+        expect(rebuilt == target, what + " round trip");
+        return delta.size();
+    }
+
+    bool rejected(string_view source, string_view delta)
+    {
+        try
+        {
+            Delta::apply(source, delta);
+        }
+        catch (const std::exception&)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    // Text with no repeated 16-byte block
+    string text(size_t size, unsigned seed)
+    {
+        mt19937 rng(seed);
+        string s(size, ' ');
+        for (char& c : s) c = char('a' + rng() % 26);
+        return s;
+    }
+
+    void test_round_trips()
+    {
+        string a = text(10000, 1);
+
+        expect(round_trip("", "", "empty") <= 1,
+               "Empty texts give only the size");
+        round_trip("", a, "from empty");
+        round_trip(a, "", "to empty");
+        expect(round_trip(a, a, "identical") <= 8,
+               "Identical texts give a single copy");
+
+        // Single edits cost about their size, wherever they are
+        expect(round_trip(a, "new " + a, "prefix edit") <= 16,
+               "Prefix edit delta size");
+        expect(round_trip(a, a + " new", "suffix edit") <= 16,
+               "Suffix edit delta size");
+        string middle = a;
+        middle.replace(5000, 10, "inserted text");
+        expect(round_trip(a, middle, "middle edit") <= 32,
+               "Middle edit delta size");
+
+        // Blocks moved around are copied, not inserted
+        string moved = a.substr(6000) + a.substr(3000, 3000) +
+                       a.substr(0, 3000);
+        expect(round_trip(a, moved, "moved blocks") <= 64,
+               "Moved blocks delta size");
+        round_trip(a, a + a, "repeated text");
+
+        // Shorter than a block, and around its size
+        const size_t sizes[] = {1, 5, 15, 16, 17, 31, 32, 33};
+        for (size_t n : sizes)
+        {
+            for (size_t m : sizes)
+            {
+                round_trip(text(n, unsigned(n)), text(m, unsigned(m + 100)),
+                           "short texts of " + to_string(n) + " and " +
+                               to_string(m) + " bytes");
+            }
+            round_trip(a.substr(0, n), a.substr(1, n), "short shifted text");
+        }
+    }
+
+    void test_random_edits()
+    {
+        mt19937 rng(42);
+        string  source = text(4000, 2);
+        for (int i = 0; i < 200; ++i)
+        {
+            string target = source;
+            int edits = 1 + rng() % 8;
+            for (int e = 0; e < edits; ++e)
+            {
+                size_t pos = rng() % (target.size() + 1);
+                size_t len = min(size_t(rng() % 100), target.size() - pos);
+                switch (rng() % 3)
+                {
+                    case 0: target.erase(pos, len); break;
+                    case 1: target.insert(pos, text(len, rng())); break;
+                    default: target.replace(pos, len, text(len / 2, rng()));
+                }
+            }
+            round_trip(source, target, "random edits #" + to_string(i));
+            source = target;
+        }
+    }
+
+    void test_invalid()
+    {
+        string a = text(1000, 3);
+        string b = a.substr(0, 300) + "edit" + a.substr(500) + "end";
+        string delta = Delta::create(a, b);
+
+        // Every operation counts towards the target size
+        for (size_t n = 0; n < delta.size(); ++n)
+        {
+            expect(rejected(a, delta.substr(0, n)),
+                   "Delta truncated to " + to_string(n) + " bytes");
+        }
+
+        // Target size, copies beyond the source, insertions beyond the
+        // delta, and unterminated or overlong varints
+        expect(rejected(a, string(1, char(b.size() & 0x7f)) + delta.substr(2)),
+               "Wrong target size");
+        expect(rejected(a, "\x0a\x15\xe8\x07"), "Copy beyond the source");
+        expect(rejected(a.substr(0, 100), delta),
+               "Delta applied to a shorter source");
+        expect(rejected(a, "\x0a\x14" "abc"), "Insertion beyond the delta");
+        expect(rejected(a, "\x0a\x80"), "Unterminated varint");
+        expect(rejected(a, string("\x0a") + string(11, '\xff') + "\x01"),
+               "Overlong varint");
+        expect(rejected(a, "\x05"), "Missing operations");
+        expect(!rejected(a, "\x03\x06xyz"), "Valid insertion");
+    }
+}
+
+int main()
+{
+    test_round_trips();
+    test_random_edits();
+    test_invalid();
+    if (failures) return 1;
+    cout << "delta_test: OK" << endl;
+    return 0;
+}
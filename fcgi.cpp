@@ -0,0 +1,575 @@
+#include "fcgi.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+    // Record types and constants from the FastCGI specification
+    const unsigned char fcgi_version_1       = 1;
+    const unsigned char fcgi_begin_request   = 1;
+    const unsigned char fcgi_abort_request   = 2;
+    const unsigned char fcgi_end_request     = 3;
+    const unsigned char fcgi_params          = 4;
+    const unsigned char fcgi_stdin           = 5;
+    const unsigned char fcgi_stdout          = 6;
+    const unsigned char fcgi_get_values      = 9;
+    const unsigned char fcgi_get_values_res  = 10;
+    const unsigned char fcgi_unknown_type    = 11;
+
+    const int fcgi_responder        = 1;
+    const int fcgi_keep_conn        = 1;
+    const int fcgi_request_complete = 0;
+    const int fcgi_cant_mpx_conn    = 1;
+    const int fcgi_unknown_role     = 3;
+
+    const size_t max_record_len = 65535;
+
+    // Input buffered per connection: one record (header, content and
+    // padding). Reading stops there while a request is being handled.
+    const size_t max_input_size  = 8 + max_record_len + 255;
+    const size_t read_chunk_size = 64 * 1024;
+
+    // Limits of a request's parameters (mostly its HTTP headers) and body,
+    // as in the HTTP server
+    const size_t max_params_size = 64 * 1024;
+    const size_t max_body_size   = 256 * 1024 * 1024;
+
+    // Also keeps the descriptor from being inherited by child processes
+    void set_nonblocking(int fd)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    // Appends a record (header, content and padding) to "out". Content
+    // longer than a record can hold is split over several records.
+    void append_record(string& out, unsigned char type, int id,
+                       const char* data, size_t len)
+    {
+        do
+        {
+            size_t chunk = len < max_record_len ? len : max_record_len;
+            size_t pad   = (8 - chunk % 8) % 8;
+            unsigned char h[8] = {fcgi_version_1, type,
+                                  (unsigned char)(id >> 8),
+                                  (unsigned char)(id & 0xFF),
+                                  (unsigned char)(chunk >> 8),
+                                  (unsigned char)(chunk & 0xFF),
+                                  (unsigned char)pad, 0};
+            out.append(reinterpret_cast<char*>(h), 8);
+            if (chunk) out.append(data, chunk);
+            out.append(pad, '\0');
+            data += chunk;
+            len  -= chunk;
+        } while (len);
+    }
+
+    void append_end_request(string& out, int id, int protocol_status)
+    {
+        char body[8] = {0, 0, 0, 0, (char)protocol_status, 0, 0, 0};
+        append_record(out, fcgi_end_request, id, body, sizeof(body));
+    }
+
+    // Reads a name or value length of a name-value pair; returns false if
+    // the buffer is too short.
+    bool read_nv_len(const string& s, size_t& pos, size_t& len)
+    {
+        if (pos >= s.size()) return false;
+        unsigned char b = s[pos];
+        if (!(b & 0x80))
+        {
+            len = b;
+            pos += 1;
+            return true;
+        }
+        if (pos + 4 > s.size()) return false;
+        len = ((size_t)(b & 0x7F) << 24) |
+              ((size_t)(unsigned char)s[pos + 1] << 16) |
+              ((size_t)(unsigned char)s[pos + 2] << 8) |
+              ((size_t)(unsigned char)s[pos + 3]);
+        pos += 4;
+        return true;
+    }
+
+    // The variables refer to "s", which must outlive "env"
+    void parse_params(const string& s, Env& env)
+    {
+        size_t pos = 0;
+        while (pos < s.size())
+        {
+            size_t name_len, value_len;
+            if (!read_nv_len(s, pos, name_len) ||
+                !read_nv_len(s, pos, value_len) ||
+                pos + name_len + value_len > s.size())
+            {
+                return;
+            }
+            string_view sv(s);
+            env.add(sv.substr(pos, name_len),
+                    sv.substr(pos + name_len, value_len));
+            pos += name_len + value_len;
+        }
+    }
+
+    // Ends a request with an error status, and no body
+    void append_error(string& out, int id, const char* status)
+    {
+        string resp = fmt("Status: %1%\n\n", status);
+        append_record(out, fcgi_stdout, id, resp.data(), resp.size());
+        append_record(out, fcgi_stdout, id, NULL, 0);
+        append_end_request(out, id, fcgi_request_complete);
+    }
+
+    // Connections that can be open at once: the descriptors left to the
+    // process, apart from some for the database and the server itself
+    size_t max_connections()
+    {
+        const rlim_t reserved = 64;
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return 1;
+        rlim_t n = rl.rlim_cur == RLIM_INFINITY ? 65536 : rl.rlim_cur;
+        return n > reserved ? n - reserved : 1;
+    }
+
+    void append_nv(string& out, const string& name, const string& value)
+    {
+        // Only used for short management values: 1-byte lengths suffice
+        out += (char)name.size();
+        out += (char)value.size();
+        out += name;
+        out += value;
+    }
+}
+
+// A request being received, with the FCGI_PARAMS stream that its
+// environment refers to
+class FcgiServer::Pending
+{
+public:
+    Request req;
+    string  params;
+};
+
+FcgiServer::FcgiServer(int listen_fd, const Handler& handler)
+    : listen_fd_(listen_fd), handler_(handler), next_id_(1),
+      accept_retry_(0)
+{
+    // A client closing its connection early must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    set_nonblocking(listen_fd_);
+
+    // Wakes up the event loop when responses are posted by other threads
+    CHECK(pipe(wake_fds_) == 0, "pipe failed: %1%", strerror(errno));
+    set_nonblocking(wake_fds_[0]);
+    set_nonblocking(wake_fds_[1]);
+}
+
+FcgiServer::~FcgiServer()
+{
+    foreach_(const auto& c, conns_) close(c.first);
+    close(wake_fds_[0]);
+    close(wake_fds_[1]);
+}
+
+void FcgiServer::run()
+{
+    loop_thread_ = this_thread::get_id();
+    vector<pollfd>   fds;
+    vector<uint64_t> ids; // Connection of each entry after the first two
+    for (;;)
+    {
+        fds.clear();
+        ids.clear();
+        bool accepting = time(NULL) >= accept_retry_;
+        fds.push_back(pollfd{wake_fds_[0], POLLIN, 0});
+        fds.push_back(pollfd{listen_fd_, short(accepting ? POLLIN : 0), 0});
+        foreach_(const auto& it, conns_)
+        {
+            const Conn& c = it.second;
+            if (c.broken) continue;
+            bool  input  = c.reading && c.in.size() < max_input_size;
+            short events = (input ? POLLIN : 0) |
+                           (c.out_pos < c.out.size() ? POLLOUT : 0);
+            fds.push_back(pollfd{c.fd, events, 0});
+            ids.push_back(c.id);
+        }
+
+        // Accepts paused for lack of descriptors are retried every second
+        int n = poll(fds.data(), fds.size(), 1000);
+        for (size_t i = 2; n > 0 && i < fds.size(); ++i)
+        {
+            short revents = fds[i].revents;
+            if (!revents) continue;
+            auto it = conns_.find(fds[i].fd);
+            if (it == conns_.end() || it->second.id != ids[i - 2]) continue;
+            if ((revents & (POLLHUP | POLLERR)) && it->second.busy)
+            {
+                // Stop polling the broken socket until the response is
+                // posted, then close it
+                it->second.broken = true;
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                on_readable(it->second);
+                it = conns_.find(fds[i].fd);
+                if (it == conns_.end()) continue;
+            }
+            if (revents & POLLOUT) on_writable(it->second);
+        }
+        if (n > 0 && fds[0].revents)
+        {
+            char buf[256];
+            while (read(wake_fds_[0], buf, sizeof(buf)) > 0) {}
+        }
+        if (n > 0 && fds[1].revents) accept_all();
+        while (run_completions()) {}
+    }
+}
+
+void FcgiServer::accept_all()
+{
+    for (;;)
+    {
+        int fd = accept(listen_fd_, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                // The pending connection would be reported again right
+                // away: wait until a connection is closed, or a second
+                accept_retry_ = time(NULL) + 1;
+            }
+            return;
+        }
+
+        set_nonblocking(fd);
+        Conn& c = conns_[fd];
+        c.fd                = fd;
+        c.id                = next_id_++;
+        c.in.clear();
+        c.out.clear();
+        c.out_pos           = 0;
+        c.req_id            = 0;
+        c.keep_conn         = false;
+        c.reading           = true;
+        c.busy              = false;
+        c.broken            = false;
+        c.close_after_write = false;
+        c.pending.reset();
+    }
+}
+
+void FcgiServer::on_readable(Conn& c)
+{
+    while (c.reading && c.in.size() < max_input_size)
+    {
+        size_t  size  = c.in.size();
+        size_t  chunk = min(read_chunk_size, max_input_size - size);
+        c.in.resize(size + chunk);
+        ssize_t n     = read(c.fd, &c.in[size], chunk);
+        int     err   = errno;
+        c.in.resize(size + (n > 0 ? n : 0));
+        if (n > 0) continue;
+        if (n < 0 && err == EINTR) continue;
+        if (n < 0 && (err == EAGAIN || err == EWOULDBLOCK)) break;
+
+        // The peer closed its side: answer what was received, then close
+        c.reading = false;
+    }
+
+    parse_records(c);
+    on_writable(c);
+}
+
+void FcgiServer::parse_records(Conn& c)
+{
+    size_t pos = 0;
+    while (!c.busy && !c.close_after_write && c.in.size() - pos >= 8)
+    {
+        const unsigned char* h =
+            reinterpret_cast<const unsigned char*>(&c.in[pos]);
+        int    type = h[1];
+        int    id   = (h[2] << 8) | h[3];
+        size_t len  = (h[4] << 8) | h[5];
+        if (c.in.size() - pos < 8 + len + h[6]) break;
+        string_view content(&c.in[pos + 8], len);
+        pos += 8 + len + h[6];
+        bool finished  = false;
+        bool too_large = false;
+
+        if (id == 0)
+        {
+            // Management record
+            if (type == fcgi_get_values)
+            {
+                // Each connection has a request at most, which waits for a
+                // worker in the pool's queue: requests are only limited by
+                // connections
+                string max_conns = to_string(max_connections());
+                string values;
+                append_nv(values, "FCGI_MAX_CONNS", max_conns);
+                append_nv(values, "FCGI_MAX_REQS", max_conns);
+                append_nv(values, "FCGI_MPXS_CONNS", "0");
+                append_record(c.out, fcgi_get_values_res, 0, values.data(),
+                              values.size());
+            }
+            else
+            {
+                char body[8] = {(char)type, 0, 0, 0, 0, 0, 0, 0};
+                append_record(c.out, fcgi_unknown_type, 0, body,
+                              sizeof(body));
+            }
+        }
+        else if (type == fcgi_begin_request && len >= 8)
+        {
+            int role = ((unsigned char)content[0] << 8) |
+                       (unsigned char)content[1];
+            if (c.req_id != 0)
+            {
+                append_end_request(c.out, id, fcgi_cant_mpx_conn);
+            }
+            else if (role != fcgi_responder)
+            {
+                append_end_request(c.out, id, fcgi_unknown_role);
+                c.keep_conn = content[2] & fcgi_keep_conn;
+                finished    = true;
+            }
+            else
+            {
+                c.req_id    = id;
+                c.keep_conn = content[2] & fcgi_keep_conn;
+                c.pending.reset(new Pending);
+            }
+        }
+        else if (id != c.req_id)
+        {
+            // Record for an inactive request: ignore it
+        }
+        else if (type == fcgi_abort_request)
+        {
+            append_end_request(c.out, id, fcgi_request_complete);
+            c.req_id = 0;
+            c.pending.reset();
+            finished = true;
+        }
+        else if (type == fcgi_params)
+        {
+            Pending& p = *c.pending;
+            if (p.params.size() + len > max_params_size)
+            {
+                append_error(c.out, id, "431 Request Header Fields Too Large");
+                too_large = true;
+            }
+            else if (len)
+            {
+                p.params += content;
+            }
+            else
+            {
+                parse_params(p.params, p.req.env);
+            }
+        }
+        else if (type == fcgi_stdin)
+        {
+            if (c.pending->req.body.size() + len > max_body_size)
+            {
+                append_error(c.out, id, "413 Payload Too Large");
+                too_large = true;
+            }
+            else if (len)
+            {
+                c.pending->req.body += content;
+            }
+            else
+            {
+                // The request shares the ownership of the parameters
+                shared_ptr<Pending> p = move(c.pending);
+                shared_ptr<Request> req(p, &p->req);
+                int      fd      = c.fd;
+                uint64_t conn_id = c.id;
+                c.busy = true;
+                try
+                {
+                    handler_(req, [this, fd, conn_id](string& out)
+                    {
+                        post(fd, conn_id, out);
+                    });
+                }
+                catch (const std::exception& ex)
+                {
+                    string out = "Status: 500 Internal Server Error\n"
+                                 "Content-type: text/plain\n\n";
+                    out += ex.what();
+                    post(fd, conn_id, out);
+                }
+            }
+        }
+
+        if (too_large)
+        {
+            // The rest of the request would still be sent: drop it with the
+            // connection
+            c.req_id = 0;
+            c.pending.reset();
+            c.close_after_write = true;
+        }
+        if (finished && !c.keep_conn) c.close_after_write = true;
+    }
+    c.in.erase(0, pos);
+}
+
+void FcgiServer::post(int fd, uint64_t id, string& out)
+{
+    Completion done;
+    done.fd  = fd;
+    done.id  = id;
+    done.out = move(out);
+    {
+        lock_guard<mutex> lock(mutex_);
+        completions_.push_back(move(done));
+    }
+    if (this_thread::get_id() != loop_thread_)
+    {
+        char one = 1;
+        ssize_t rc = write(wake_fds_[1], &one, 1);
+        (void)rc;
+    }
+}
+
+// Sends the posted responses; returns false if there were none
+bool FcgiServer::run_completions()
+{
+    deque<Completion> done;
+    {
+        lock_guard<mutex> lock(mutex_);
+        done.swap(completions_);
+    }
+    if (done.empty()) return false;
+
+    foreach_(auto& d, done)
+    {
+        auto it = conns_.find(d.fd);
+        if (it == conns_.end() || it->second.id != d.id) continue;
+        Conn& c = it->second;
+        if (c.broken)
+        {
+            close_conn(c.fd);
+            continue;
+        }
+
+        append_record(c.out, fcgi_stdout, c.req_id, d.out.data(),
+                      d.out.size());
+        append_record(c.out, fcgi_stdout, c.req_id, NULL, 0);
+        append_end_request(c.out, c.req_id, fcgi_request_complete);
+        c.req_id = 0;
+        c.busy   = false;
+        if (!c.keep_conn) c.close_after_write = true;
+
+        // Continue with the records received meanwhile
+        parse_records(c);
+        on_writable(c);
+    }
+    return true;
+}
+
+void FcgiServer::on_writable(Conn& c)
+{
+    while (c.out_pos < c.out.size())
+    {
+        ssize_t n = write(c.fd, c.out.data() + c.out_pos,
+                          c.out.size() - c.out_pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0)
+        {
+            close_conn(c.fd);
+            return;
+        }
+        c.out_pos += n;
+    }
+
+    if (c.out_pos == c.out.size())
+    {
+        c.out.clear();
+        c.out_pos = 0;
+        if (!c.busy && (c.close_after_write || !c.reading))
+        {
+            close_conn(c.fd);
+        }
+    }
+}
+
+void FcgiServer::close_conn(int fd)
+{
+    close(fd);
+    conns_.erase(fd);
+    // A descriptor is available again
+    accept_retry_ = 0;
+}
+
+int FcgiServer::listen_socket(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (string(argv[i]) != "--fcgi") continue;
+        CHECK(i + 1 < argc, "Usage: %1% --fcgi [host:]port", argv[0]);
+
+        string addr(argv[i + 1]);
+        string host;
+        string port = addr;
+        string::size_type colon = addr.rfind(':');
+        if (colon != string::npos)
+        {
+            host = addr.substr(0, colon);
+            port = addr.substr(colon + 1);
+        }
+
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        addrinfo* ai = NULL;
+        int rc = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                             &hints, &ai);
+        CHECK(rc == 0, "Invalid address %1%: %2%", addr, gai_strerror(rc));
+
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        rc = bind(fd, ai->ai_addr, ai->ai_addrlen);
+        freeaddrinfo(ai);
+        CHECK(fd >= 0 && rc == 0 && listen(fd, SOMAXCONN) == 0,
+              "Can't listen on %1%: %2%", addr, strerror(errno));
+        return fd;
+    }
+
+    // A FastCGI process spawned by the web server gets its listening socket
+    // as stdin, on which getpeername fails with ENOTCONN
+    sockaddr_storage sa;
+    socklen_t        sa_len = sizeof(sa);
+    if (getpeername(0, reinterpret_cast<sockaddr*>(&sa), &sa_len) != 0 &&
+        errno == ENOTCONN)
+    {
+        return 0;
+    }
+    return -1;
+}
+
@@ -0,0 +1,94 @@
+#ifndef FCGI_H
+#define FCGI_H
+
+#include "handler.h"
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// Minimal FastCGI responder (see the FastCGI 1.0 specification). Requests
+// are not multiplexed on a connection, which is what web servers do in
+// practice; FCGI_MPXS_CONNS is reported as 0 to them. Requests with more
+// parameters or body than the HTTP server allows get a 431 or 413, and
+// their connection is closed.
+//
+// Connections are served by a poll() event loop, which reads and parses
+// the records, and passes each complete request to the handler. The handler
+// may answer right away, or hand the request over to another thread (e.g. a
+// WorkerPool) that answers later, so idle persistent connections
+// (FCGI_KEEP_CONN) hold no thread.
+class FcgiServer
+{
+public:
+    // Sends the CGI output (headers, blank line, body) of a request. Must be
+    // called exactly once per request, from any thread.
+    typedef std::function<void(std::string& out)> Reply;
+
+    typedef std::function<void(const std::shared_ptr<Request>& req,
+                               const Reply& reply)> Handler;
+
+    FcgiServer(int listen_fd, const Handler& handler);
+    ~FcgiServer();
+
+    // Runs the event loop. Never returns.
+    void run();
+
+    // Returns the FastCGI listening socket to use, or -1 when the process
+    // was invoked as a classic CGI program. The socket is either given
+    // with "--fcgi [host:]port" on the command line, or is file descriptor
+    // 0 when the web server spawned the process (FCGI_LISTENSOCK_FILENO).
+    static int listen_socket(int argc, char* argv[]);
+
+private:
+    class Pending;
+
+    struct Conn
+    {
+        int                      fd;
+        uint64_t                 id;      // Distinguishes reused fds
+        std::string              in;
+        std::string              out;
+        size_t                   out_pos;
+        int                      req_id;  // Request received or handled
+        bool                     keep_conn;
+        bool                     reading; // False once the peer stopped
+        bool                     busy;    // A request is being handled
+        bool                     broken;  // Socket error while busy
+        bool                     close_after_write;
+        std::shared_ptr<Pending> pending; // Request being received
+    };
+
+    struct Completion
+    {
+        int         fd;
+        uint64_t    id;
+        std::string out;
+    };
+
+    void accept_all();
+    void on_readable(Conn& c);
+    void on_writable(Conn& c);
+    void parse_records(Conn& c);
+    void post(int fd, uint64_t id, std::string& out);
+    bool run_completions();
+    void close_conn(int fd);
+
+    int                           listen_fd_;
+    int                           wake_fds_[2]; // Pipe waking up the loop
+    Handler                       handler_;
+    std::unordered_map<int, Conn> conns_;
+    uint64_t                      next_id_;
+    time_t                        accept_retry_; // Accepts paused until then
+    std::thread::id               loop_thread_;
+    std::mutex                    mutex_;
+    std::deque<Completion>        completions_;
+};
+
+#endif
@@ -0,0 +1,95 @@
+// Microbenchmark of the form parsers on large note bodies:
+//
+//     form_bench [MB] [iterations]
+//
+// Compares Form (in place decoding) with Params (lookup only, no decoding)
+// and with the boost::tokenizer based build_map() that was used before
+// them, on a PUT /note/<id> body of the given size (4 MB by default).
+
+#include "params.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/tokenizer.hpp>
+
+using namespace boost;
+using namespace std;
+
+namespace
+{
+    typedef tokenizer<char_separator<char>> char_tok;
+    typedef char_separator<char> char_sep;
+
+    map<string, string> build_map(const string& s,
+                                  const string& pair_delim,
+                                  const string& pair_item_delim)
+    {
+        map<string, string> m;
+        char_tok tok(s, char_sep(pair_delim.c_str()));
+        BOOST_FOREACH(const string& pair_string, tok)
+        {
+            char_tok tok2(pair_string, char_sep(pair_item_delim.c_str()));
+            vector<string> v(tok2.begin(), tok2.end());
+            if (v.size() > 1) m[v[0]] = v[1];
+        }
+        return m;
+    }
+
+    // Body as sent by jQuery: words separated by '+', with some escapes
+    string make_body(size_t size)
+    {
+        string content;
+        while (content.size() < size)
+        {
+            content += "Lorem+ipsum+dolor+sit+amet%2C+consectetur+adipiscing+"
+                       "elit.%0AUt+enim+ad+minim+veniam%3A+%22quis%22+nostrud+";
+        }
+        return "title=Some+note&content=" + content;
+    }
+
+    template <typename F>
+    void run(const string& name, const string& body, long iterations, F f)
+    {
+        size_t check = 0;
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < iterations; ++i) check += f();
+        double s = chrono::duration<double>(chrono::steady_clock::now() -
+                                            start).count();
+        cout << name << ": " << s / iterations * 1000 << " ms, "
+             << body.size() * iterations / s / 1e6 << " MB/s (" << check
+             << ")" << endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    double mb         = argc > 1 ? atof(argv[1]) : 4;
+    long   iterations = argc > 2 ? atol(argv[2]) : 20;
+    string body       = make_body(size_t(mb * 1e6));
+
+    run("build_map", body, iterations, [&]
+    {
+        return build_map(body, "&", "=")["content"].size();
+    });
+    run("Params   ", body, iterations, [&]
+    {
+        return Params(body, "&")["content"].size();
+    });
+    run("Form     ", body, iterations, [&]
+    {
+        string buf(body); // Decoding is destructive
+        return Form(buf)["content"].size();
+    });
+    run("copy only", body, iterations, [&]
+    {
+        string buf(body);
+        return buf.size();
+    });
+    return 0;
+}
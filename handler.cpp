@@ -0,0 +1,1021 @@
+// REST API for notera web app
+//
+// /session
+//     GET   : Returns the current state of the session.
+//             Returned values:
+//                 - auth : 1 if session is authenticated, 0 otherwise.
+//                 - user : the user associated with the session, if any.
+//                 - salt : the salt associated with the user, if any.
+//     POST  : Authenticate session (login).
+//             Parameters:
+//                 - token: the security token, defined as follows:
+//                          SHA1(user + SHA1(pwd + salt) + sid)
+//             Returned values:
+//                 - auth : 1 if authentication was accepted, 0 otherwise.
+//             In stateless session mode, the session token is returned in
+//             the "st" cookie.
+//     DELETE: Delete the current session (logout).
+//
+// /session/<user>
+//     PUT   : Associate the session with a specific user.
+//             Returned values:
+//                 - salt : the salt associated with the user.
+//
+// /user/<user>
+//     POST  : Create a new user. 
+//             Parameters:
+//                 - pwd_hash: SHA1(pwd + salt)
+//
+// /note
+//     GET   : Get the list of notes, a page at a time
+//             Parameters (query string):
+//                 - order : "id" (default) or "mtime" (most recently
+//                           modified first)
+//                 - limit : maximum number of notes (100 by default, at
+//                           most 1000)
+//                 - cursor: next_cursor of the previous page, if any
+//             Returned values:
+//                 - note_list  : [id, title, mtime] of each note
+//                 - next_cursor: cursor of the next page, if any
+//     POST  : Create a new note
+//             Returned values:
+//                 - id: the id of the new note
+//
+// /note/<id>
+//     GET   : Get the contents of the note. The response has an ETag,
+//             and 304 (Not Modified) is returned without content if it
+//             matches If-None-Match (the same holds for the note list).
+//             Returned values:
+//                 - title
+//                 - content     : if at most 1 MiB (see /content otherwise)
+//                 - content_size: size of the content in bytes, if larger
+//                 - version     : the version of the note (see PATCH)
+//     PUT   : Update the contents of the note
+//             Parameters:
+//                 - title
+//                 - content
+//     PATCH : Edit the contents of the note, if it has not changed since
+//             the version the edits are based on
+//             Parameters:
+//                 - version: the base version
+//                 - title  : the new title (unchanged if omitted)
+//                 - splice : "<offset>,<length>,<text>", replacing length
+//                            bytes at offset in the UTF-8 content by text;
+//                            repeated, and applied in order, each to the
+//                            result of the previous ones
+//             Returned values:
+//                 - version: the new version of the note, or its current
+//                            version if it has changed (error "conflict")
+//     DELETE: Delete the note
+//
+// /content/<id>
+//     GET   : Get the raw content of the note (text/plain), with the same
+//             ETag as the note. A single byte range can be asked for with
+//             a Range header ("bytes=<first>-<last>", "bytes=<first>-" or
+//             "bytes=-<suffix length>"), which gets a 206 (Partial
+//             Content) response. At most 1 MiB is returned at a time: a
+//             larger range gets its first MiB, as told by Content-Range,
+//             and a content larger than 1 MiB must be asked for in ranges
+//             (error "range_required" otherwise). Other Range headers
+//             (e.g. several ranges) are ignored. Errors are returned as
+//             JSON, with status 416 for unsatisfiable ranges.
+//
+// /revision/<id>
+//     GET   : Get the revisions of the note (the states it had after each
+//             update), newest first, or one of them
+//             Parameters (query string):
+//                 - version: the revision to get (all of them if omitted)
+//                 - limit  : maximum number of revisions (100 by default,
+//                            at most 1000)
+//                 - before : next_before of the previous page, if any
+//             Returned values, when listing:
+//                 - revisions  : [version, mtime, size, title] of each
+//                                revision
+//                 - next_before: before of the next page, if any
+//             Returned values, for a single revision:
+//                 - title, content, mtime
+//     POST  : Restore a revision, as a new update of the note
+//             Parameters:
+//                 - version: the revision to restore
+//             Returned values:
+//                 - version: the new version of the note
+//
+// /changes
+//     GET   : Get the changes to the notes since the last sync, in order
+//             Parameters (query string):
+//                 - since: next_since of the last sync (all the notes if
+//                          omitted)
+//                 - limit: maximum number of changes (100 by default, at
+//                          most 1000)
+//             Returned values:
+//                 - changes   : [version, id, title, content] of each note
+//                               created or updated, [version, id] of each
+//                               note deleted. Contents larger than 1 MiB
+//                               are read through /content: their notes come
+//                               as [version, id, title, null, content size].
+//                               A page holds at most 8 MiB of contents.
+//                 - next_since: since of the next sync
+//                 - more      : true if there are more changes to get
+//
+// /merkle
+//     GET   : Get a node of the Merkle tree of the notes, to find the notes
+//             that differ from a copy by comparing subtrees, from the root
+//             down (see DB::get_merkle_node for the hashes)
+//             Parameters (query string):
+//                 - level: level of the node (the root's by default); notes
+//                          are in the leaves, at level 0
+//                 - index: index of the node in its level, below
+//                          16^(12 - level) (0 by default)
+//             Returned values:
+//                 - level, index: of the node
+//                 - hash    : hash of the node, empty if it has no notes
+//                 - children: [index, hash] of each non-empty child (nodes)
+//                 - notes   : [id, digest] of each note (leaves)
+//
+// /search
+//     GET   : Search the notes, best matches first
+//             Parameters (query string):
+//                 - q     : the words to search; a word ending with '*'
+//                           matches as a prefix
+//                 - limit : maximum number of results (20 by default, at
+//                           most 100)
+//                 - offset: number of results to skip (0 by default)
+//             Returned values:
+//                 - search_results: [id, title, snippet] of each note, the
+//                   matched words being delimited by \u0002 and \u0003 in
+//                   the snippet
+//                 - next_offset   : offset of the next page, if any
+
+#include "handler.h"
+#include "session_tokens.h"
+#include "sha1.h"
+#include "sqlite_wrapper.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+
+#include <sys/uio.h>
+
+using namespace std;
+
+// Rejects the API call with the given ApiError, unless cond is true
+#define REQUIRE(cond, code) if (!(cond)) return ApiError::code;
+
+namespace
+{
+    // Notes with larger contents are read through /content
+    const int64_t max_inline_content = 1 << 20;
+
+    // Request bodies (and note contents) are only echoed for debugging up
+    // to this size
+    const size_t max_trace = 1024;
+
+    // JSON values of the "error_code" and "error" members, by ApiError
+    const struct
+    {
+        const char* code;
+        const char* message;
+    } api_errors[] = {
+        {"null", "null"},
+        {"\"no_session\"",     "\"Must register a session first\""},
+        {"\"no_token\"",       "\"No token submitted\""},
+        {"\"unknown_user\"",   "\"User not defined\""},
+        {"\"missing_p2\"",     "\"p2 not provided\""},
+        {"\"user_not_found\"", "\"User does not exist; please create a "
+                               "session first with PUT /session/<user>\""},
+        {"\"rejected\"",       "\"Request rejected\""},
+        {"\"unauthorized\"",   "\"Unauthorized\""},
+        {"\"missing_query\"",  "\"q not provided\""},
+        {"\"invalid_page\"",   "\"Invalid limit, offset or cursor\""},
+        {"\"invalid_order\"",  "\"Invalid order\""},
+        {"\"invalid_node\"",   "\"Invalid level or index\""},
+        {"\"note_not_found\"", "\"Note not found\""},
+        {"\"conflict\"",       "\"Note modified since the base version\""},
+        {"\"invalid_patch\"",  "\"Invalid version or splice\""},
+        {"\"invalid_range\"",  "\"Invalid range\""},
+        {"\"range_required\"", "\"Content too large: ask for ranges\""},
+        {"\"no_revision\"",    "\"Revision not found\""},
+    };
+    static_assert(sizeof(api_errors) / sizeof(api_errors[0]) ==
+                  size_t(ApiError::COUNT));
+}
+
+int64_t gen_sid(DB& db)
+{
+    int64_t sid = db.random_int64();
+    if (sid < 0)
+    {
+        sid += 1; // Add 1 to avoid overflowing, if the negative number was
+                  // the smallest one possible
+        sid *= -1;
+    }
+    if (sid == 0) return 1;
+    return sid;
+}
+
+// Forgets the session token, if any (in stateless session mode)
+void drop_token(SessionTokens* tokens, string_view token, Resp& resp)
+{
+    if (!tokens || token.empty()) return;
+    tokens->revoke(token);
+    resp.set_cookie("st", "", 0);
+}
+
+Env parse_env(char* env[])
+{
+    Env e;
+    for (; *env; ++env)
+    {
+        const char* eq = strchr(*env, '=');
+        CHECK(eq, "Invalid environment string: %s", *env)
+        e.add(string_view(*env, eq - *env), string_view(eq + 1));
+    }
+    return e;
+}
+
+Resp::Resp()
+    : json_(body_), status_(200), reason_("OK"),
+      content_type_("application/json"), error_(ApiError::NONE),
+      complete_(false)
+{
+    json_.begin_object();
+}
+
+void Resp::set_raw_body(string&& body, const string& content_type)
+{
+    body_         = move(body);
+    content_type_ = content_type;
+    complete_     = true;
+}
+
+void Resp::set_cookie(const string& name, const string& value, long max_age)
+{
+    headers.push_back(fmt("Set-Cookie: %1%=%2%; Max-Age=%3%; HttpOnly",
+                          name, value, max_age));
+}
+
+void Resp::set_status(int status, const string& reason)
+{
+    status_ = status;
+    reason_ = reason;
+}
+
+void Resp::emit(string& out)
+{
+    out += cgi_headers();
+    out += body();
+}
+
+void Resp::emit(int fd)
+{
+    string head = cgi_headers();
+    body();
+    iovec iov[2];
+    iov[0].iov_base = &head[0];
+    iov[0].iov_len  = head.size();
+    iov[1].iov_base = &body_[0];
+    iov[1].iov_len  = body_.size();
+
+    // Only a pipe or socket that is full or interrupted writes less
+    int i = 0;
+    while (i < 2)
+    {
+        ssize_t n = writev(fd, iov + i, 2 - i);
+        if (n < 0 && errno == EINTR) continue;
+        CHECK(n >= 0, "Can't write response: %1%", strerror(errno));
+        for (; i < 2 && size_t(n) >= iov[i].iov_len; ++i) n -= iov[i].iov_len;
+        if (i < 2)
+        {
+            iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+            iov[i].iov_len -= n;
+        }
+    }
+}
+
+string& Resp::body()
+{
+    if (complete_) return body_;
+    complete_ = true;
+    if (status_ == 304)
+    {
+        body_.clear();
+        return body_;
+    }
+
+    // Members left open by an error are closed
+    while (json_.depth() > 1) json_.end();
+    if (error_ != ApiError::NONE)
+    {
+        const auto& e = api_errors[size_t(error_)];
+        json_.key("error").raw(e.message).key("error_code").raw(e.code);
+    }
+    foreach_(const auto& d, data) json_.key(d.first).value(d.second);
+    json_.end_object();
+    body_ += '\n';
+    return body_;
+}
+
+string Resp::cgi_headers() const
+{
+    string head;
+    if (status_ != 200) fmt_to(head, "Status: %1% %2%\n", status_, reason_);
+    fmt_to(head, "Content-type: %1%\n", content_type_);
+    foreach_(const auto& h, headers)
+    {
+        head += h;
+        head += '\n';
+    }
+    head += '\n';
+    return head;
+}
+
+namespace
+{
+    // An API call being processed
+    class Call
+    {
+    public:
+        DB&                     db;
+        SessionTokens*          tokens;
+        const Env&              env;
+        Form&                   post_data;
+        Form&                   query_string;
+        Resp&                   resp;
+        string_view             sid;
+        string_view             token; // session token, if any
+        std::optional<Session>& ses;
+    };
+
+    ApiError session_call(Call& c)
+    {
+        auto& db           = c.db;
+        auto& env          = c.env;
+        auto& post_data    = c.post_data;
+        auto& query_string = c.query_string;
+        auto& resp         = c.resp;
+        auto& ses          = c.ses;
+        auto  sid          = c.sid;
+
+        // For session management API calls, return the SID cookie, to will
+        // avoid having to mess with cookies on the client side, and the
+        // cookie can be made HttpOnly
+        resp.data["sid"]    = sid;
+
+        if (env["REQUEST_METHOD"] == "GET")
+        {
+            resp.data["step"]   = "2";
+            if (ses)
+            {
+                CHECK(!ses->user.empty(), "User name should be defined here.");
+                resp.data["user"] = ses->user;
+                resp.data["auth"] = fmt("%1%", ses->auth);
+                auto u = db.get_user(ses->user);
+                CHECK(u, "User %1% should have already been created here",
+                      ses->user);
+                resp.data["salt"] = u->salt;
+            }
+        }
+        else if (env["REQUEST_METHOD"] == "POST")
+        {
+            REQUIRE(ses, NO_SESSION);
+            REQUIRE(!post_data["token"].empty(), NO_TOKEN);
+
+            resp.data["step"]   = "3";
+            // Construct the expected auth token
+            auto u = db.get_user(ses->user);
+            REQUIRE(u, UNKNOWN_USER);
+            Sha1 sha(ses->user);
+            sha.update(u->pwd_hash);
+            sha.update(string(sid));
+            sha.result();
+            unsigned int* s = sha.Message_Digest;
+            string expected_auth_token = fmt("%08x%08x%08x%08x%08x", s[0],
+                                             s[1], s[2], s[3], s[4]);
+
+            // For debug
+            resp.data["expected_auth_token"] = expected_auth_token;
+            resp.data["user"] = ses->user;
+            resp.data["pwd_hash"] = u->pwd_hash;
+            resp.data["sid"] = sid;
+
+            // Compare the expected auth token to the submitted one
+            if (expected_auth_token == post_data["token"])
+            {
+                resp.data["step"]   = "4";
+                // User is authenticated
+                if (c.tokens)
+                {
+                    Session s = *ses;
+                    s.auth = 1;
+                    resp.set_cookie("st", c.tokens->issue(sid, s),
+                                    max_session_age - s.age);
+                }
+                else
+                {
+                    db.set_session_auth(sid);
+                }
+                resp.data["auth"] = "1";
+            }
+            else
+            {
+                //db.delete_session(sid);
+            }
+        }
+        else if (env["REQUEST_METHOD"] == "PUT")
+        {
+            if (ses)
+            {
+                db.delete_session(sid);
+            }
+            drop_token(c.tokens, c.token, resp);
+            resp.data["step"]   = "5";
+            REQUIRE(!query_string["p2"].empty(), MISSING_P2);
+            resp.data["step"]   = "5a";
+            auto u = db.get_user(query_string["p2"]);
+            resp.data["step"]   = "5b";
+            if (!u)
+            {
+                resp.data["step"]   = "5c";
+                u = db.insert_user(query_string["p2"]);
+            }
+            resp.data["step"]   = "6";
+            db.insert_session(sid, query_string["p2"]);
+            resp.data["salt"] = u->salt;
+        }
+        else if (env["REQUEST_METHOD"] == "DELETE")
+        {
+            if (ses) db.delete_session(sid);
+            drop_token(c.tokens, c.token, resp);
+        }
+        return ApiError::NONE;
+    }
+
+    ApiError user_call(Call& c)
+    {
+        if (c.env["REQUEST_METHOD"] == "POST")
+        {
+            c.resp.data["step"]   = "7";
+            auto u = c.db.get_user(c.query_string["p2"]);
+            REQUIRE(u, USER_NOT_FOUND);
+            REQUIRE(u->pwd_hash.empty(), REJECTED);
+            c.db.set_user_pwd_hash(c.query_string["p2"],
+                                   c.post_data["pwd_hash"]);
+        }
+        return ApiError::NONE;
+    }
+
+    // Parses a non-negative integer parameter, which may be missing
+    bool parse_count(string_view s, int64_t def, int64_t& n)
+    {
+        n = def;
+        if (s.empty()) return true;
+        auto r = from_chars(s.data(), s.data() + s.size(), n);
+        return r.ec == errc() && r.ptr == s.data() + s.size() && n >= 0;
+    }
+
+    // Parses a single byte range of content of the given size (see
+    // /content). Returns false if the header is not a single valid byte
+    // range, which is then ignored (RFC 9110, section 14.2); otherwise,
+    // "satisfiable" tells whether the range holds any of the content.
+    bool parse_range(string_view range, int64_t size, int64_t& first,
+                     int64_t& last, bool& satisfiable)
+    {
+        const string_view unit = "bytes=";
+        if (range.substr(0, unit.size()) != unit) return false;
+        range.remove_prefix(unit.size());
+        auto dash = range.find('-');
+        if (dash == string_view::npos || range.size() == 1) return false;
+        string_view a = range.substr(0, dash);
+        string_view b = range.substr(dash + 1);
+        if (a.empty())
+        {
+            // Suffix range
+            int64_t n;
+            if (!parse_count(b, 0, n)) return false;
+            satisfiable = n > 0 && size > 0;
+            first       = max(size - n, int64_t(0));
+            last        = size - 1;
+            return true;
+        }
+        int64_t f, l;
+        if (!parse_count(a, 0, f) ||
+            !parse_count(b, numeric_limits<int64_t>::max(), l) || l < f)
+        {
+            return false;
+        }
+        satisfiable = f < size;
+        first       = f;
+        last        = min(l, size - 1);
+        return true;
+    }
+
+    ApiError search_call(Call& c)
+    {
+        const int64_t max_limit = 100;
+
+        REQUIRE(c.ses && c.ses->auth, UNAUTHORIZED);
+        if (c.env["REQUEST_METHOD"] != "GET") return ApiError::NONE;
+        REQUIRE(!c.query_string["q"].empty(), MISSING_QUERY);
+        int64_t limit;
+        int64_t offset;
+        REQUIRE(parse_count(c.query_string["limit"], 20, limit) &&
+                parse_count(c.query_string["offset"], 0, offset) &&
+                limit <= max_limit, INVALID_PAGE);
+
+        // One more result than asked tells whether there is a next page
+        auto& json  = c.resp.json();
+        int64_t count = 0;
+        json.key("search_results").begin_array();
+        c.db.search_notes(c.ses->user, c.query_string["q"], limit + 1, offset,
+                          [&](int64_t id, string_view title,
+                              string_view snippet)
+        {
+            if (++count > limit) return;
+            json.begin_array().value(id).value(title).value(snippet)
+                .end_array();
+        });
+        json.end_array();
+        if (count > limit) json.key("next_offset").value(offset + limit);
+        return ApiError::NONE;
+    }
+
+    string note_etag(string_view id, int64_t version)
+    {
+        return fmt("\"%1%.%2%\"", id, version);
+    }
+
+    // Whether an If-None-Match header matches the entity tag
+    bool etag_matches(string_view header, string_view etag)
+    {
+        while (!header.empty())
+        {
+            size_t comma = header.find(',');
+            string_view tag = header.substr(0, comma);
+            header = comma == string_view::npos ? string_view()
+                                                : header.substr(comma + 1);
+            while (!tag.empty() && tag.front() == ' ') tag.remove_prefix(1);
+            while (!tag.empty() && tag.back() == ' ') tag.remove_suffix(1);
+            if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+            if (tag == "*" || tag == etag) return true;
+        }
+        return false;
+    }
+
+    // Sets the entity tag of the response. The client must revalidate its
+    // copy on each use, as notes change from other clients.
+    void set_etag(Call& c, const string& etag)
+    {
+        c.resp.add_header("ETag: " + etag);
+        c.resp.add_header("Cache-Control: private, no-cache");
+    }
+
+    // Answers 304 (Not Modified) if the client has the current version
+    bool not_modified(Call& c, const string& etag)
+    {
+        if (!etag_matches(c.env["HTTP_IF_NONE_MATCH"], etag)) return false;
+        set_etag(c, etag);
+        c.resp.set_status(304, "Not Modified");
+        return true;
+    }
+
+    // Cursors of the note list, opaque to the clients: "<id>" of the last
+    // note listed when ordering by ID, "<mtime>.<id>" otherwise
+    string note_cursor(NoteOrder order, const NoteKey& k)
+    {
+        if (order == NoteOrder::ID) return fmt("%1%", k.id);
+        return fmt("%1%.%2%", k.mtime, k.id);
+    }
+
+    bool parse_note_cursor(string_view s, NoteOrder order,
+                           std::optional<NoteKey>& key)
+    {
+        if (s.empty()) return true;
+        NoteKey k{0, 0};
+        const char* p   = s.data();
+        const char* end = s.data() + s.size();
+        if (order == NoteOrder::MTIME)
+        {
+            auto r = from_chars(p, end, k.mtime);
+            if (r.ec != errc() || r.ptr == end || *r.ptr != '.') return false;
+            p = r.ptr + 1;
+        }
+        auto r = from_chars(p, end, k.id);
+        if (r.ec != errc() || r.ptr != end) return false;
+        key = k;
+        return true;
+    }
+
+    ApiError list_notes(Call& c)
+    {
+        const int64_t max_limit = 1000;
+
+        string_view order_name = c.query_string["order"];
+        REQUIRE(order_name.empty() || order_name == "id" ||
+                order_name == "mtime", INVALID_ORDER);
+        NoteOrder order = order_name == "mtime" ? NoteOrder::MTIME
+                                                : NoteOrder::ID;
+        int64_t limit;
+        std::optional<NoteKey> after;
+        REQUIRE(parse_count(c.query_string["limit"], 100, limit) &&
+                limit <= max_limit &&
+                parse_note_cursor(c.query_string["cursor"], order, after),
+                INVALID_PAGE);
+
+        // Any change to the user's notes changes the list's entity tag
+        string etag = fmt("\"l%1%\"", c.db.get_notes_version(c.ses->user));
+        if (not_modified(c, etag)) return ApiError::NONE;
+        set_etag(c, etag);
+
+        // One more note than asked tells whether there is a next page
+        auto&   json  = c.resp.json();
+        int64_t count = 0;
+        NoteKey last{0, 0};
+        json.key("note_list").begin_array();
+        c.db.get_note_list(c.ses->user, order, after, limit + 1,
+                           [&](int64_t id, int64_t mtime, string_view title)
+        {
+            if (++count > limit) return;
+            json.begin_array().value(id).value(title).value(mtime)
+                .end_array();
+            last = NoteKey{mtime, id};
+        });
+        json.end_array();
+        if (count > limit)
+        {
+            json.key("next_cursor").value(note_cursor(order, last));
+        }
+        return ApiError::NONE;
+    }
+
+    ApiError changes_call(Call& c)
+    {
+        const int64_t max_limit        = 1000;
+        const int64_t max_page_content = 8 << 20;
+
+        REQUIRE(c.ses && c.ses->auth, UNAUTHORIZED);
+        if (c.env["REQUEST_METHOD"] != "GET") return ApiError::NONE;
+        int64_t since;
+        int64_t limit;
+        REQUIRE(parse_count(c.query_string["since"], -1, since) &&
+                parse_count(c.query_string["limit"], 100, limit) &&
+                limit <= max_limit, INVALID_PAGE);
+
+        // Read before the changes: if more happen meanwhile, they are
+        // returned by the next call
+        int64_t current = c.db.get_notes_version(c.ses->user);
+
+        // One more change than asked tells whether there are more
+        auto&   json  = c.resp.json();
+        int64_t count = 0;
+        int64_t last  = since;
+        json.key("changes").begin_array();
+        bool full = c.db.get_changes(
+            c.ses->user, since, limit + 1, max_inline_content,
+            max_page_content,
+            [&](int64_t version, int64_t id, bool deleted, string_view title,
+                string_view content, int64_t size)
+        {
+            if (++count > limit) return;
+            json.begin_array().value(version).value(id);
+            if (!deleted)
+            {
+                json.value(title);
+                if (size <= max_inline_content) json.value(content);
+                else json.null().value(size);
+            }
+            json.end_array();
+            last = version;
+        });
+        json.end_array();
+        bool more = count > limit || full;
+        json.key("next_since").value(more ? last : max(last, current));
+        json.key("more").value(more);
+        return ApiError::NONE;
+    }
+
+    ApiError merkle_call(Call& c)
+    {
+        REQUIRE(c.ses && c.ses->auth, UNAUTHORIZED);
+        if (c.env["REQUEST_METHOD"] != "GET") return ApiError::NONE;
+        int64_t level;
+        int64_t index;
+        string  hash;
+        REQUIRE(parse_count(c.query_string["level"], DB::merkle_top(),
+                            level) &&
+                parse_count(c.query_string["index"], 0, index) &&
+                level <= DB::merkle_top() &&
+                c.db.get_merkle_node(c.ses->user, level, index, hash),
+                INVALID_NODE);
+
+        auto& json = c.resp.json();
+        json.key("level").value(level);
+        json.key("index").value(index);
+        json.key("hash").value(hash);
+        json.key(level ? "children" : "notes").begin_array();
+        c.db.get_merkle_children(c.ses->user, level, index,
+                                 [&json](int64_t idx, string_view hash)
+        {
+            json.begin_array().value(idx).value(hash).end_array();
+        });
+        json.end_array();
+        return ApiError::NONE;
+    }
+
+    ApiError content_call(Call& c)
+    {
+        const int64_t max_chunk = 1 << 20;
+
+        REQUIRE(c.ses && c.ses->auth, UNAUTHORIZED);
+        if (c.env["REQUEST_METHOD"] != "GET") return ApiError::NONE;
+        string_view id = c.query_string["p2"];
+        REQUIRE(!id.empty(), MISSING_P2);
+        auto note = c.db.open_note_content(id, c.ses->user);
+        REQUIRE(note, NOTE_NOT_FOUND);
+        string etag = note_etag(id, note->version);
+        if (not_modified(c, etag)) return ApiError::NONE;
+
+        int64_t size  = note->blob->size();
+        int64_t first = 0;
+        int64_t last  = size - 1;
+        string_view range = c.env["HTTP_RANGE"];
+        bool satisfiable  = true;
+        if (!range.empty() &&
+            !parse_range(range, size, first, last, satisfiable))
+        {
+            range = string_view();
+        }
+        if (!satisfiable)
+        {
+            c.resp.set_status(416, "Range Not Satisfiable");
+            c.resp.add_header(fmt("Content-Range: bytes */%1%", size));
+            return ApiError::INVALID_RANGE;
+        }
+
+        // The body only holds the bytes returned, read in place; 206 is
+        // only an answer to a Range request
+        REQUIRE(!range.empty() || size <= max_chunk, RANGE_REQUIRED);
+        if (!range.empty())
+        {
+            last = min(last, first + max_chunk - 1);
+            c.resp.set_status(206, "Partial Content");
+            c.resp.add_header(fmt("Content-Range: bytes %1%-%2%/%3%", first,
+                                  last, size));
+        }
+        string body(last - first + 1, '\0');
+        note->blob->read(&body[0], body.size(), first);
+        set_etag(c, etag);
+        c.resp.add_header("Accept-Ranges: bytes");
+        c.resp.set_raw_body(move(body), "text/plain; charset=utf-8");
+        return ApiError::NONE;
+    }
+
+    ApiError revision_call(Call& c)
+    {
+        const int64_t max_limit = 1000;
+
+        REQUIRE(c.ses && c.ses->auth, UNAUTHORIZED);
+        string_view id = c.query_string["p2"];
+        REQUIRE(!id.empty(), MISSING_P2);
+        auto& json = c.resp.json();
+
+        if (c.env["REQUEST_METHOD"] == "POST")
+        {
+            int64_t revision;
+            int64_t version;
+            REQUIRE(!c.post_data["version"].empty() &&
+                    parse_count(c.post_data["version"], 0, revision),
+                    NO_REVISION);
+            auto result = c.db.restore_revision(id, c.ses->user, revision,
+                                                version);
+            REQUIRE(result != RestoreResult::NOT_FOUND, NOTE_NOT_FOUND);
+            REQUIRE(result != RestoreResult::NO_REVISION, NO_REVISION);
+            json.key("version").value(version);
+            return ApiError::NONE;
+        }
+        if (c.env["REQUEST_METHOD"] != "GET") return ApiError::NONE;
+
+        if (!c.query_string["version"].empty())
+        {
+            int64_t version;
+            auto write = [&json](string_view title, string_view content,
+                                 int64_t mtime)
+            {
+                json.key("title").value(title)
+                    .key("content").value(content)
+                    .key("mtime").value(mtime);
+            };
+            REQUIRE(parse_count(c.query_string["version"], 0, version) &&
+                    c.db.get_revision(id, c.ses->user, version, write),
+                    NO_REVISION);
+            return ApiError::NONE;
+        }
+
+        int64_t before;
+        int64_t limit;
+        REQUIRE(parse_count(c.query_string["before"], INT64_MAX, before) &&
+                parse_count(c.query_string["limit"], 100, limit) &&
+                limit <= max_limit, INVALID_PAGE);
+        // One more revision than asked tells whether there is a next page
+        int64_t count = 0;
+        int64_t last  = before;
+        json.key("revisions").begin_array();
+        c.db.get_revisions(id, c.ses->user, before, limit + 1,
+                           [&](int64_t version, int64_t mtime, int64_t size,
+                               string_view title)
+        {
+            if (++count > limit) return;
+            json.begin_array().value(version).value(mtime).value(size)
+                .value(title).end_array();
+            last = version;
+        });
+        json.end_array();
+        if (count > limit) json.key("next_before").value(last);
+        return ApiError::NONE;
+    }
+
+    // Parses "<offset>,<length>,<text>"
+    bool parse_splice(string_view s, Splice& splice)
+    {
+        auto comma1 = s.find(',');
+        if (comma1 == string_view::npos) return false;
+        auto comma2 = s.find(',', comma1 + 1);
+        if (comma2 == string_view::npos) return false;
+        splice.text = s.substr(comma2 + 1);
+        return comma1 > 0 && comma2 > comma1 + 1 &&
+               parse_count(s.substr(0, comma1), 0, splice.offset) &&
+               parse_count(s.substr(comma1 + 1, comma2 - comma1 - 1), 0,
+                           splice.length);
+    }
+
+    ApiError patch_note(Call& c)
+    {
+        REQUIRE(!c.query_string["p2"].empty(), MISSING_P2);
+        int64_t base;
+        REQUIRE(!c.post_data["version"].empty() &&
+                parse_count(c.post_data["version"], 0, base), INVALID_PATCH);
+        optional<string_view> title;
+        vector<Splice> splices;
+        bool valid = true;
+        c.post_data.for_each([&](string_view key, string_view value)
+        {
+            if (key == "title") title = value;
+            if (key != "splice") return;
+            splices.emplace_back();
+            valid = valid && parse_splice(value, splices.back());
+        });
+        REQUIRE(valid, INVALID_PATCH);
+
+        int64_t version;
+        auto result = c.db.patch_note(c.query_string["p2"], c.ses->user, base,
+                                      title, splices, version);
+        REQUIRE(result != PatchResult::NOT_FOUND, NOTE_NOT_FOUND);
+        c.resp.json().key("version").value(version);
+        REQUIRE(result != PatchResult::CONFLICT, CONFLICT);
+        REQUIRE(result != PatchResult::INVALID, INVALID_PATCH);
+        return ApiError::NONE;
+    }
+
+    ApiError note_call(Call& c)
+    {
+        auto& db           = c.db;
+        auto& env          = c.env;
+        auto& post_data    = c.post_data;
+        auto& query_string = c.query_string;
+        auto& resp         = c.resp;
+        auto& ses          = c.ses;
+
+        REQUIRE(ses && ses->auth, UNAUTHORIZED);
+
+        if (env["REQUEST_METHOD"] == "GET")
+        {
+            if (query_string["p2"].empty()) return list_notes(c);
+
+            // The version is checked first, so that the content is not
+            // read when the client has it already
+            auto version = db.get_note_version(query_string["p2"], ses->user);
+            if (version && not_modified(c, note_etag(query_string["p2"],
+                                                     *version)))
+            {
+                return ApiError::NONE;
+            }
+            db.get_note(query_string["p2"], ses->user, max_inline_content,
+                        [&](string_view title, string_view content,
+                            int64_t version, int64_t size)
+            {
+                set_etag(c, note_etag(query_string["p2"], version));
+                auto& json = resp.json();
+                json.key("title").value(title);
+                if (size <= max_inline_content)
+                {
+                    json.key("content").value(content);
+                }
+                else json.key("content_size").value(size);
+                json.key("version").value(version);
+            });
+        }
+        else if (env["REQUEST_METHOD"] == "POST")
+        {
+            resp.data["note_id"] = fmt("%1%", db.insert_note(ses->user));
+        }
+        else if (env["REQUEST_METHOD"] == "DELETE")
+        {
+            REQUIRE(!query_string["p2"].empty(), MISSING_P2);
+            db.delete_note(query_string["p2"], ses->user);
+        }
+        else if (env["REQUEST_METHOD"] == "PUT")
+        {
+            REQUIRE(!query_string["p2"].empty(), MISSING_P2);
+            resp.data["title"] = post_data["title"];
+            if (post_data["content"].size() <= max_trace)
+            {
+                resp.data["content"] = post_data["content"];
+            }
+            db.update_note(query_string["p2"], ses->user,
+                           post_data["title"], post_data["content"]);
+        }
+        else if (env["REQUEST_METHOD"] == "PATCH")
+        {
+            return patch_note(c);
+        }
+        return ApiError::NONE;
+    }
+}
+
+void handle_request(DB& db, Request& req, Resp& resp, SessionTokens* tokens)
+{
+    resp.data["auth"] = "0";
+
+    try
+    {
+        // Parse the request's data
+        auto& env         = req.env;
+        bool trace_post = req.body.size() <= max_trace;
+        if (trace_post) resp.data["raw_post"] = req.body; // Before decoding
+        Form post_data(req.body);
+        string query(env["QUERY_STRING"]);
+        Form query_string(query);
+        Params cookies(env["HTTP_COOKIE"], "; ,");
+        req.timer.route   = query_string["p1"];
+        req.timer.method  = env["REQUEST_METHOD"];
+        req.timer.phase("parse");
+
+        // Log the request
+        db.log(env);
+        req.timer.phase("log");
+
+        // Get the current session ID, setting the cookie if necessary
+        string_view sid = cookies["sid"];
+        string      new_sid;
+        if (sid.empty())
+        {
+            new_sid = fmt("%1%", gen_sid(db));
+            sid     = new_sid;
+            resp.set_cookie("sid", new_sid, max_session_age);
+        }
+
+        // Load the current session, from the session token if there is a
+        // valid one
+        string_view token = cookies["st"];
+        std::optional<Session> ses;
+        if (tokens && !token.empty()) ses = tokens->verify(token, sid);
+        if (!ses) ses = db.get_session(sid);
+        req.timer.phase("session");
+
+        // Trace some things for debugging purposes
+        resp.data["method"] = env["REQUEST_METHOD"];
+        resp.data["p1"]     = query_string["p1"];
+        resp.data["p2"]     = query_string["p2"];
+        resp.data["step"]   = "1";
+	if (trace_post) post_data.for_each([&resp](string_view key,
+	                                           string_view value)
+	{
+	    string& trace = resp.data["post_data"];
+	    trace.append(key).append(", ").append(value).append(", ");
+	});
+
+        // Process API calls
+        Call c{db, tokens, env, post_data, query_string, resp, sid, token,
+               ses};
+        ApiError err = ApiError::NONE;
+        if      (query_string["p1"] == "session")  err = session_call(c);
+        else if (query_string["p1"] == "user")     err = user_call(c);
+        else if (query_string["p1"] == "note")     err = note_call(c);
+        else if (query_string["p1"] == "search")   err = search_call(c);
+        else if (query_string["p1"] == "changes")  err = changes_call(c);
+        else if (query_string["p1"] == "merkle")   err = merkle_call(c);
+        else if (query_string["p1"] == "content")  err = content_call(c);
+        else if (query_string["p1"] == "revision") err = revision_call(c);
+        resp.fail(err);
+    }
+    catch (const std::exception& ex)
+    {
+        resp.data["error"] = ex.what();
+    }
+    req.timer.phase("handler");
+}
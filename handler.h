@@ -0,0 +1,123 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include "db.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include "params.h"
+#include "session_tokens.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// A single API request, as received through CGI or FastCGI: the CGI
+// environment variables and the raw request body. The timer starts when
+// the request is created.
+class Request
+{
+public:
+    Env          env;
+    std::string  body;
+    RequestTimer timer;
+};
+
+// Expected failures of API calls, reported without throwing: the response
+// gets preformatted "error" (message) and "error_code" members. Exceptions
+// are kept for internal failures, reported with their message only.
+enum class ApiError
+{
+    NONE,
+    NO_SESSION,     // POST /session without a session
+    NO_TOKEN,       // POST /session without a token
+    UNKNOWN_USER,   // session of a user that no longer exists
+    MISSING_P2,     // missing user or note ID
+    USER_NOT_FOUND, // POST /user/<user> without PUT /session/<user> first
+    REJECTED,       // password already set
+    UNAUTHORIZED,   // note or search call without an authenticated session
+    MISSING_QUERY,  // GET /search without q
+    INVALID_PAGE,   // invalid limit, offset or cursor
+    INVALID_ORDER,  // unknown note list order
+    INVALID_NODE,   // GET /merkle with an invalid level or index
+    NOTE_NOT_FOUND, // PATCH of a note that does not exist
+    CONFLICT,       // PATCH of a note changed since the base version
+    INVALID_PATCH,  // PATCH without a version, or with an invalid splice
+    INVALID_RANGE,  // GET /content with an unsatisfiable or invalid Range
+    RANGE_REQUIRED, // GET /content of a large note without a Range
+    NO_REVISION,    // missing or unknown revision version
+    COUNT
+};
+
+// Response to an API call. The JSON body is built in a single buffer: the
+// members written with json() as the request is processed, followed by the
+// string fields of "data".
+class Resp
+{
+public:
+    Resp();
+    Resp(const Resp&) = delete;
+    Resp& operator=(const Resp&) = delete;
+
+    void set_cookie(const std::string& name, const std::string& value,
+                    long max_age);
+
+    // Adds a header line (without the line break)
+    void add_header(const std::string& line) { headers.push_back(line); }
+
+    // HTTP status, 200 by default. A 304 (Not Modified) response has no
+    // body.
+    void set_status(int status, const std::string& reason);
+    int status() const { return status_; }
+    const std::string& reason() const { return reason_; }
+
+    // Rejects the call (ApiError::NONE does nothing)
+    void fail(ApiError e) { if (e != ApiError::NONE) error_ = e; }
+
+    ApiError api_error() const { return error_; }
+
+    // Writer for the members of the body's top-level object
+    JsonWriter& json() { return json_; }
+
+    // Replaces the JSON body (and the strings of data) by raw bytes of the
+    // given content type
+    void set_raw_body(std::string&& body, const std::string& content_type);
+    const std::string& content_type() const { return content_type_; }
+
+    // Appends the CGI response (headers, blank line and body) to out
+    void emit(std::string& out);
+
+    // Writes the CGI response to a file descriptor, in one writev() call
+    void emit(int fd);
+
+    // Completes the JSON body and returns it (empty if the status is 304)
+    std::string& body();
+
+    const std::vector<std::string>& get_headers() const { return headers; }
+
+    std::map<std::string, std::string> data;
+
+private:
+    std::string cgi_headers() const;
+
+    std::vector<std::string> headers;
+    std::string              body_;
+    JsonWriter               json_;
+    int                      status_;
+    std::string              reason_;
+    std::string              content_type_;
+    ApiError                 error_;
+    bool                     complete_;
+};
+
+// Returns the process environment, which is not copied
+Env parse_env(char* env[]);
+
+// Processes one API call against the given database. Errors are reported in
+// the "error" field of the response (see ApiError); this function does not
+// throw. If tokens is given, authenticated sessions are carried by signed
+// session tokens instead of the session table.
+void handle_request(DB& db, Request& req, Resp& resp,
+                    SessionTokens* tokens = NULL);
+
+#endif
+
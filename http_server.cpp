@@ -0,0 +1,538 @@
+#include "http_server.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+    const size_t max_header_size = 64 * 1024;
+    const size_t max_body_size   = 256 * 1024 * 1024;
+    // Input buffered per connection: the largest request, pipelined or not.
+    // Reading stops there until the requests in the buffer are handled.
+    const size_t max_input_size  = max_header_size + 4 + max_body_size;
+    const size_t read_chunk_size = 64 * 1024;
+    const int    max_events      = 256;
+    const time_t idle_timeout    = 60;
+
+    string to_lower(string s)
+    {
+        transform(s.begin(), s.end(), s.begin(), ::tolower);
+        return s;
+    }
+
+    string trim(const string& s)
+    {
+        string::size_type b = s.find_first_not_of(" \t");
+        if (b == string::npos) return string();
+        string::size_type e = s.find_last_not_of(" \t");
+        return s.substr(b, e - b + 1);
+    }
+
+    // Parses the request line and headers of "s"; returns false if they are
+    // malformed.
+    bool parse_head(const string& s, HttpRequest& req)
+    {
+        string::size_type eol = s.find("\r\n");
+        string line = s.substr(0, eol);
+        string::size_type sp1 = line.find(' ');
+        string::size_type sp2 = line.rfind(' ');
+        if (sp1 == string::npos || sp1 == sp2) return false;
+        req.method  = line.substr(0, sp1);
+        req.target  = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        req.version = line.substr(sp2 + 1);
+        if (req.version.compare(0, 5, "HTTP/") != 0) return false;
+
+        while (eol != string::npos)
+        {
+            string::size_type start = eol + 2;
+            eol = s.find("\r\n", start);
+            line = s.substr(start, eol == string::npos ? string::npos
+                                                       : eol - start);
+            if (line.empty()) continue;
+            string::size_type colon = line.find(':');
+            if (colon == string::npos) return false;
+            req.headers.push_back(make_pair(to_lower(line.substr(0, colon)),
+                                            trim(line.substr(colon + 1))));
+        }
+        return true;
+    }
+
+    // Reads the body length given by the Content-Length headers (0 without
+    // any); returns false if one is not a plain decimal number, or if they
+    // disagree, as the end of the request would then be ambiguous
+    bool content_length(const HttpRequest& req, size_t& len)
+    {
+        bool found = false;
+        len = 0;
+        foreach_(const auto& h, req.headers)
+        {
+            if (h.first != "content-length") continue;
+            const char* end = h.second.data() + h.second.size();
+            size_t n;
+            auto r = from_chars(h.second.data(), end, n);
+            if (h.second.empty() || r.ec != errc() || r.ptr != end ||
+                (found && n != len))
+            {
+                return false;
+            }
+            found = true;
+            len   = n;
+        }
+        return true;
+    }
+
+    bool has_token(const string* value, const string& token)
+    {
+        return value && to_lower(*value).find(token) != string::npos;
+    }
+}
+
+const string* HttpRequest::header(const string& name) const
+{
+    foreach_(const auto& h, headers)
+    {
+        if (h.first == name) return &h.second;
+    }
+    return NULL;
+}
+
+HttpServer::HttpServer(const string& host, const string& port,
+                       const Handler& handler)
+    : listen_fd_(-1), epoll_fd_(-1), event_fd_(-1), handler_(handler),
+      next_id_(1), last_sweep_(0), accept_retry_(0)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    addrinfo* ai = NULL;
+    int rc = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                         &hints, &ai);
+    CHECK(rc == 0, "Invalid address %1%:%2%: %3%", host, port,
+          gai_strerror(rc));
+
+    listen_fd_ = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+                        SOCK_CLOEXEC, ai->ai_protocol);
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    rc = bind(listen_fd_, ai->ai_addr, ai->ai_addrlen);
+    freeaddrinfo(ai);
+    CHECK(listen_fd_ >= 0 && rc == 0 && listen(listen_fd_, SOMAXCONN) == 0,
+          "Can't listen on %1%:%2%: %3%", host, port, strerror(errno));
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    CHECK(epoll_fd_ >= 0, "epoll_create1 failed: %1%", strerror(errno));
+    epoll_event ev;
+    ev.events  = EPOLLIN;
+    ev.data.fd = listen_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+
+    // Wakes up the event loop when responses are posted by other threads
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CHECK(event_fd_ >= 0, "eventfd failed: %1%", strerror(errno));
+    ev.data.fd = event_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+}
+
+HttpServer::~HttpServer()
+{
+    foreach_(const auto& c, conns_) close(c.first);
+    if (event_fd_ >= 0) close(event_fd_);
+    if (epoll_fd_ >= 0) close(epoll_fd_);
+    if (listen_fd_ >= 0) close(listen_fd_);
+}
+
+void HttpServer::run()
+{
+    loop_thread_ = this_thread::get_id();
+    epoll_event events[max_events];
+    for (;;)
+    {
+        int n = epoll_wait(epoll_fd_, events, max_events, 1000);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd_)
+            {
+                accept_all();
+                continue;
+            }
+            if (fd == event_fd_)
+            {
+                uint64_t count;
+                while (read(event_fd_, &count, sizeof(count)) > 0) {}
+                continue;
+            }
+
+            auto it = conns_.find(fd);
+            if (it == conns_.end()) continue;
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) && it->second.busy)
+            {
+                // Stop polling the broken socket until the response is
+                // posted, then close it
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+                it->second.broken = true;
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                on_readable(it->second);
+                it = conns_.find(fd);
+                if (it == conns_.end()) continue;
+            }
+            if (events[i].events & EPOLLOUT) on_writable(it->second);
+        }
+        while (run_completions()) {}
+        close_idle();
+        if (accept_retry_ && time(NULL) >= accept_retry_) resume_accept();
+    }
+}
+
+void HttpServer::accept_all()
+{
+    for (;;)
+    {
+        sockaddr_in sa;
+        socklen_t   sa_len = sizeof(sa);
+        int fd = accept4(listen_fd_, reinterpret_cast<sockaddr*>(&sa),
+                         &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                // The pending connection would be reported again right
+                // away: stop polling the listening socket until a
+                // connection is closed, or a second
+                epoll_event ev;
+                ev.events  = 0;
+                ev.data.fd = listen_fd_;
+                epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, listen_fd_, &ev);
+                accept_retry_ = time(NULL) + 1;
+            }
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        char addr[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &sa.sin_addr, addr, sizeof(addr));
+        Conn& c = conns_[fd];
+        c.fd                = fd;
+        c.id                = next_id_++;
+        c.addr              = addr;
+        c.port              = ntohs(sa.sin_port);
+        c.out_pos           = 0;
+        c.events            = EPOLLIN;
+        c.reading           = true;
+        c.busy              = false;
+        c.head              = false;
+        c.keep_alive        = false;
+        c.broken            = false;
+        c.close_after_write = false;
+        c.last_active       = time(NULL);
+
+        epoll_event ev;
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void HttpServer::on_readable(Conn& c)
+{
+    c.last_active = time(NULL);
+    while (c.reading && c.in.size() < max_input_size)
+    {
+        size_t size  = c.in.size();
+        size_t chunk = min(read_chunk_size, max_input_size - size);
+        c.in.resize(size + chunk);
+        ssize_t n     = read(c.fd, &c.in[size], chunk);
+        int     err   = errno;
+        c.in.resize(size + (n > 0 ? n : 0));
+        if (n > 0) continue;
+        if (n < 0 && err == EINTR) continue;
+        if (n < 0 && (err == EAGAIN || err == EWOULDBLOCK)) break;
+
+        // The peer closed its side: answer what was received, then close
+        c.reading = false;
+    }
+
+    if (!c.close_after_write && !parse_requests(c))
+    {
+        c.close_after_write = true;
+    }
+    on_writable(c);
+}
+
+bool HttpServer::parse_requests(Conn& c)
+{
+    size_t pos = 0;
+    bool   ok  = true;
+    while (ok && !c.close_after_write && !c.busy)
+    {
+        size_t head_end = c.in.find("\r\n\r\n", pos);
+        if (head_end == string::npos || head_end - pos > max_header_size)
+        {
+            if (head_end != string::npos ||
+                c.in.size() - pos > max_header_size)
+            {
+                HttpResponse resp;
+                resp.status = 431;
+                resp.reason = "Request Header Fields Too Large";
+                append_response(c, resp, false);
+                ok = false;
+            }
+            break;
+        }
+
+        HttpRequest req;
+        req.remote_addr = c.addr;
+        req.remote_port = c.port;
+        HttpResponse resp;
+        if (!parse_head(c.in.substr(pos, head_end - pos), req))
+        {
+            resp.status = 400;
+            resp.reason = "Bad Request";
+            append_response(c, resp, false);
+            ok = false;
+            break;
+        }
+        if (req.header("transfer-encoding"))
+        {
+            resp.status = 501;
+            resp.reason = "Not Implemented";
+            append_response(c, resp, false);
+            ok = false;
+            break;
+        }
+
+        size_t body_len;
+        if (!content_length(req, body_len))
+        {
+            resp.status = 400;
+            resp.reason = "Bad Request";
+            append_response(c, resp, false);
+            ok = false;
+            break;
+        }
+        if (body_len > max_body_size)
+        {
+            resp.status = 413;
+            resp.reason = "Payload Too Large";
+            append_response(c, resp, false);
+            ok = false;
+            break;
+        }
+        size_t body_start = head_end + 4;
+        if (c.in.size() - body_start < body_len)
+        {
+            // Wait for the rest of the body
+            if (has_token(req.header("expect"), "100-continue") &&
+                c.in.size() == body_start)
+            {
+                c.out += "HTTP/1.1 100 Continue\r\n\r\n";
+            }
+            break;
+        }
+        req.body = c.in.substr(body_start, body_len);
+        pos = body_start + body_len;
+
+        c.keep_alive = req.version == "HTTP/1.1"
+                     ? !has_token(req.header("connection"), "close")
+                     : has_token(req.header("connection"), "keep-alive");
+        c.head = req.method == "HEAD";
+        c.busy = true;
+
+        int      fd = c.fd;
+        uint64_t id = c.id;
+        try
+        {
+            handler_(req, [this, fd, id](HttpResponse& r) { post(fd, id, r); });
+        }
+        catch (const std::exception& ex)
+        {
+            resp.status = 500;
+            resp.reason = "Internal Server Error";
+            resp.body   = ex.what();
+            post(fd, id, resp);
+        }
+    }
+    c.in.erase(0, pos);
+    return ok;
+}
+
+void HttpServer::post(int fd, uint64_t id, HttpResponse& resp)
+{
+    Completion done;
+    done.fd   = fd;
+    done.id   = id;
+    done.resp = move(resp);
+    {
+        lock_guard<mutex> lock(mutex_);
+        completions_.push_back(move(done));
+    }
+    if (this_thread::get_id() != loop_thread_)
+    {
+        uint64_t one = 1;
+        ssize_t rc = write(event_fd_, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+// Sends the posted responses; returns false if there were none
+bool HttpServer::run_completions()
+{
+    deque<Completion> done;
+    {
+        lock_guard<mutex> lock(mutex_);
+        done.swap(completions_);
+    }
+    if (done.empty()) return false;
+
+    foreach_(auto& d, done)
+    {
+        auto it = conns_.find(d.fd);
+        if (it == conns_.end() || it->second.id != d.id) continue;
+        Conn& c = it->second;
+        if (c.broken)
+        {
+            close_conn(c.fd);
+            continue;
+        }
+
+        append_response(c, d.resp, c.keep_alive, c.head);
+        c.busy = false;
+        if (!c.keep_alive) c.close_after_write = true;
+
+        // Continue with the pipelined requests
+        if (!c.close_after_write && !parse_requests(c))
+        {
+            c.close_after_write = true;
+        }
+        on_writable(c);
+    }
+    return true;
+}
+
+void HttpServer::append_response(Conn& c, const HttpResponse& resp,
+                                 bool keep_alive, bool head)
+{
+    fmt_to(c.out, "HTTP/1.1 %1% %2%\r\n", resp.status, resp.reason);
+    foreach_(const auto& h, resp.headers)
+    {
+        c.out += h;
+        c.out += "\r\n";
+    }
+    // 304 responses have no body, and their length would be the one of
+    // the full response. HEAD responses have the length of the GET one.
+    if (resp.status != 304)
+    {
+        fmt_to(c.out, "Content-Length: %1%\r\n", resp.body.size());
+    }
+    c.out += keep_alive ? "Connection: keep-alive\r\n\r\n"
+                        : "Connection: close\r\n\r\n";
+    if (!head) c.out += resp.body;
+}
+
+void HttpServer::on_writable(Conn& c)
+{
+    while (c.out_pos < c.out.size())
+    {
+        ssize_t n = write(c.fd, c.out.data() + c.out_pos,
+                          c.out.size() - c.out_pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0)
+        {
+            close_conn(c.fd);
+            return;
+        }
+        c.out_pos += n;
+    }
+
+    if (c.out_pos == c.out.size())
+    {
+        c.out.clear();
+        c.out_pos = 0;
+        if (!c.busy && (c.close_after_write || !c.reading))
+        {
+            close_conn(c.fd);
+            return;
+        }
+    }
+    update_events(c);
+}
+
+void HttpServer::update_events(Conn& c)
+{
+    bool     input  = c.reading && c.in.size() < max_input_size;
+    uint32_t events = (input ? uint32_t(EPOLLIN) : 0u) |
+                      (c.out.empty() ? 0u : uint32_t(EPOLLOUT));
+    if (events == c.events) return;
+    c.events = events;
+    epoll_event ev;
+    ev.events  = events;
+    ev.data.fd = c.fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void HttpServer::close_conn(int fd)
+{
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    conns_.erase(fd);
+    // A descriptor is available again
+    if (accept_retry_) resume_accept();
+}
+
+void HttpServer::resume_accept()
+{
+    accept_retry_ = 0;
+    epoll_event ev;
+    ev.events  = EPOLLIN;
+    ev.data.fd = listen_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, listen_fd_, &ev);
+}
+
+void HttpServer::close_idle()
+{
+    time_t now = time(NULL);
+    if (now - last_sweep_ < idle_timeout / 4) return;
+    last_sweep_ = now;
+
+    vector<int> idle;
+    foreach_(const auto& c, conns_)
+    {
+        if (c.second.out.empty() && !c.second.busy &&
+            now - c.second.last_active > idle_timeout)
+        {
+            idle.push_back(c.first);
+        }
+    }
+    foreach_(int fd, idle) close_conn(fd);
+}
+
@@ -0,0 +1,121 @@
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class HttpRequest
+{
+public:
+    // Returns the value of a header (name in lower case), or NULL
+    const std::string* header(const std::string& name) const;
+
+    std::string method;
+    std::string target;
+    std::string version;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    std::string remote_addr;
+    int         remote_port;
+};
+
+class HttpResponse
+{
+public:
+    HttpResponse() : status(200), reason("OK") {}
+
+    int                      status;
+    std::string              reason;
+    std::vector<std::string> headers; // Full header lines, without CRLF
+    std::string              body;
+};
+
+// HTTP/1.1 server built on a non-blocking epoll event loop. Connections are
+// kept alive unless the client asks otherwise, and pipelined requests are
+// answered in order. The listening socket is opened with SO_REUSEPORT, so
+// several server processes can share the same port.
+//
+// Requests are passed to the handler on the event loop thread. The handler
+// may answer right away, or hand the request over to another thread (e.g. a
+// WorkerPool) that answers later; a connection has at most one request in
+// flight, so responses stay in order.
+class HttpServer
+{
+public:
+    // Sends the response to a request. Must be called exactly once per
+    // request, from any thread.
+    typedef std::function<void(HttpResponse& resp)> Reply;
+
+    typedef std::function<void(HttpRequest& req,
+                               const Reply& reply)> Handler;
+
+    HttpServer(const std::string& host, const std::string& port,
+               const Handler& handler);
+    ~HttpServer();
+
+    // Runs the event loop. Never returns.
+    void run();
+
+private:
+    struct Conn
+    {
+        int         fd;
+        uint64_t    id;           // Distinguishes connections reusing an fd
+        std::string addr;
+        int         port;
+        std::string in;
+        std::string out;
+        size_t      out_pos;
+        uint32_t    events;       // Events registered with epoll
+        bool        reading;      // False once the peer stopped sending
+        bool        busy;         // A request is being handled
+        bool        head;         // The request in flight is a HEAD
+        bool        keep_alive;   // Keep-alive of the request in flight
+        bool        broken;       // Socket error while a request was busy
+        bool        close_after_write;
+        time_t      last_active;
+    };
+
+    struct Completion
+    {
+        int          fd;
+        uint64_t     id;
+        HttpResponse resp;
+    };
+
+    void accept_all();
+    void on_readable(Conn& c);
+    void on_writable(Conn& c);
+    bool parse_requests(Conn& c);
+    void post(int fd, uint64_t id, HttpResponse& resp);
+    bool run_completions();
+    void append_response(Conn& c, const HttpResponse& resp, bool keep_alive,
+                         bool head = false);
+    void update_events(Conn& c);
+    void close_conn(int fd);
+    void resume_accept();
+    void close_idle();
+
+    int                           listen_fd_;
+    int                           epoll_fd_;
+    int                           event_fd_;
+    Handler                       handler_;
+    std::unordered_map<int, Conn> conns_;
+    uint64_t                      next_id_;
+    time_t                        last_sweep_;
+    time_t                        accept_retry_; // Accepts paused until then
+    std::thread::id               loop_thread_;
+    std::mutex                    mutex_;
+    std::deque<Completion>        completions_;
+};
+
+#endif
+
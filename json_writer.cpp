@@ -0,0 +1,183 @@
+#include "json_writer.h"
+
+#include <cstdio>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    bool needs_escape(unsigned char c)
+    {
+        return c < 0x20 || c == '"' || c == '\\';
+    }
+
+    // Returns the position of the first character of s that must be
+    // escaped, from "pos", or s.size()
+    size_t find_escape(string_view s, size_t pos)
+    {
+#ifdef __SSE2__
+        // 16 characters at a time: control characters are those for which
+        // max(c, 0x1f) == 0x1f
+        const __m128i quote     = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control   = _mm_set1_epi8(0x1f);
+        for (; pos + 16 <= s.size(); pos += 16)
+        {
+            __m128i v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(s.data() + pos));
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                             _mm_cmpeq_epi8(v, backslash)),
+                _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+            int mask = _mm_movemask_epi8(m);
+            if (mask) return pos + __builtin_ctz(mask);
+        }
+#endif
+        while (pos < s.size() && !needs_escape(s[pos])) ++pos;
+        return pos;
+    }
+}
+
+JsonWriter::JsonWriter(string& out) : out_(out), after_key_(false)
+{
+}
+
+JsonWriter& JsonWriter::begin_object()
+{
+    separate();
+    out_ += '{';
+    open_.push_back(Open{'}', true});
+    return *this;
+}
+
+JsonWriter& JsonWriter::end_object()
+{
+    return end();
+}
+
+JsonWriter& JsonWriter::begin_array()
+{
+    separate();
+    out_ += '[';
+    open_.push_back(Open{']', true});
+    return *this;
+}
+
+JsonWriter& JsonWriter::end_array()
+{
+    return end();
+}
+
+JsonWriter& JsonWriter::end()
+{
+    if (after_key_) null();
+    out_ += open_.back().close;
+    open_.pop_back();
+    return *this;
+}
+
+JsonWriter& JsonWriter::key(string_view name)
+{
+    separate();
+    escape(out_, name);
+    out_ += ": ";
+    after_key_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(string_view s)
+{
+    separate();
+    escape(out_, s);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(int64_t n)
+{
+    separate();
+    char buf[24];
+    out_.append(buf, snprintf(buf, sizeof(buf), "%lld",
+                              static_cast<long long>(n)));
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(double n)
+{
+    separate();
+    char buf[32];
+    out_.append(buf, snprintf(buf, sizeof(buf), "%.17g", n));
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(bool b)
+{
+    separate();
+    out_ += b ? "true" : "false";
+    return *this;
+}
+
+JsonWriter& JsonWriter::null()
+{
+    separate();
+    out_ += "null";
+    return *this;
+}
+
+JsonWriter& JsonWriter::raw(string_view json)
+{
+    separate();
+    out_ += json;
+    return *this;
+}
+
+void JsonWriter::escape(string& out, string_view s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out.reserve(out.size() + s.size() + 2);
+    out += '"';
+    size_t pos = 0;
+    for (;;)
+    {
+        // Copy the run of characters that need no escaping in one go
+        size_t end = find_escape(s, pos);
+        out.append(s.data() + pos, end - pos);
+        if (end == s.size()) break;
+
+        unsigned char c = s[end];
+        switch (c)
+        {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b";  break;
+        case '\f': out += "\\f";  break;
+        case '\n': out += "\\n";  break;
+        case '\r': out += "\\r";  break;
+        case '\t': out += "\\t";  break;
+        default:
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+        pos = end + 1;
+    }
+    out += '"';
+}
+
+// Writes the comma before a member, unless it is the first one or the value
+// of a key
+void JsonWriter::separate()
+{
+    if (after_key_)
+    {
+        after_key_ = false;
+        return;
+    }
+    if (open_.empty()) return;
+    if (!open_.back().first) out_ += ", ";
+    open_.back().first = false;
+}
@@ -0,0 +1,60 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Writes JSON text to the end of a string, as it is produced: commas are
+// inserted automatically between the members of objects and arrays, and
+// strings are escaped. Objects and arrays must be properly nested.
+class JsonWriter
+{
+public:
+    explicit JsonWriter(std::string& out);
+
+    JsonWriter& begin_object();
+    JsonWriter& end_object();
+    JsonWriter& begin_array();
+    JsonWriter& end_array();
+
+    // Closes the innermost object or array, whichever it is (a pending key
+    // gets a null value)
+    JsonWriter& end();
+
+    // Number of open objects and arrays
+    size_t depth() const { return open_.size(); }
+
+    // Member name, to be followed by its value
+    JsonWriter& key(std::string_view name);
+
+    JsonWriter& value(std::string_view s);
+    JsonWriter& value(const char* s) { return value(std::string_view(s)); }
+    JsonWriter& value(int64_t n);
+    JsonWriter& value(double n);
+    JsonWriter& value(bool b);
+    JsonWriter& null();
+
+    // Value already encoded as JSON, written as is
+    JsonWriter& raw(std::string_view json);
+
+    // Appends s as a JSON string literal
+    static void escape(std::string& out, std::string_view s);
+
+private:
+    void separate();
+
+    class Open
+    {
+    public:
+        char close; // '}' or ']'
+        bool first; // no member written yet
+    };
+
+    std::string&      out_;
+    std::vector<Open> open_;
+    bool              after_key_;
+};
+
+#endif
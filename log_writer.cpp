@@ -0,0 +1,91 @@
+#include "log_writer.h"
+#include "util.h"
+
+#include <iostream>
+
+using namespace std;
+
+LogWriter::LogWriter(const string& db_path, size_t max_queue,
+                     size_t max_batch, chrono::milliseconds max_delay)
+    : db_(db_path), max_queue_(max_queue), max_batch_(max_batch),
+      max_delay_(max_delay), dropped_(0), stop_(false),
+      thread_([this] { run(); })
+{
+}
+
+LogWriter::~LogWriter()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    if (dropped_)
+    {
+        cerr << "Log queue full: " << dropped_ << " records dropped" << endl;
+    }
+}
+
+void LogWriter::push(LogRecord rec)
+{
+    bool wake;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (queue_.size() >= max_queue_)
+        {
+            ++dropped_;
+            return;
+        }
+        queue_.push_back(move(rec));
+        wake = queue_.size() == 1 || queue_.size() == max_batch_;
+    }
+    if (wake) cond_.notify_one();
+}
+
+void LogWriter::run()
+{
+    deque<LogRecord> batch;
+    for (;;)
+    {
+        {
+            unique_lock<mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+
+            // Give the batch some time to fill up
+            auto deadline = chrono::steady_clock::now() + max_delay_;
+            cond_.wait_until(lock, deadline, [this]
+            {
+                return stop_ || queue_.size() >= max_batch_;
+            });
+            if (queue_.empty()) return;
+            batch.swap(queue_);
+        }
+        write(batch);
+        batch.clear();
+    }
+}
+
+void LogWriter::write(deque<LogRecord>& batch)
+{
+    try
+    {
+        db_.exec("BEGIN");
+        try
+        {
+            foreach_(const auto& rec, batch) db_.insert_log(rec);
+            db_.exec("COMMIT");
+        }
+        catch (...)
+        {
+            db_.exec("ROLLBACK");
+            throw;
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        // Losing log records is better than stopping the writer
+        cerr << "Can't write " << batch.size() << " log records: "
+             << ex.what() << endl;
+    }
+}
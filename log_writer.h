@@ -0,0 +1,54 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include "db.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Writes the request log in the background, so that requests don't wait for
+// a commit of their own. Records are queued in memory and inserted by a
+// writer thread, with its own connection, in one transaction per batch. A
+// batch is written when max_batch records are pending, or when the oldest
+// pending record has waited max_delay. When the queue is full, new records
+// are dropped (and counted) rather than blocking the request. Records still
+// queued when the process is killed are lost.
+class LogWriter
+{
+public:
+    LogWriter(const std::string& db_path, size_t max_queue = 4096,
+              size_t max_batch = 256,
+              std::chrono::milliseconds max_delay =
+                  std::chrono::milliseconds(1000));
+
+    // Writes the pending records
+    ~LogWriter();
+
+    void push(LogRecord rec);
+
+    // Number of records dropped because the queue was full
+    uint64_t dropped() const { return dropped_; }
+
+private:
+    void run();
+    void write(std::deque<LogRecord>& batch);
+
+    DB                        db_;
+    const size_t              max_queue_;
+    const size_t              max_batch_;
+    std::chrono::milliseconds max_delay_;
+    std::mutex                mutex_;
+    std::condition_variable   cond_;
+    std::deque<LogRecord>     queue_;
+    std::atomic<uint64_t>     dropped_;
+    bool                      stop_;
+    std::thread               thread_;
+};
+
+#endif
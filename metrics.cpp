@@ -0,0 +1,150 @@
+#include "metrics.h"
+#include "util.h"
+
+#include <ctime>
+#include <fstream>
+
+using namespace std;
+
+namespace
+{
+    // Upper bounds of the histogram buckets, in seconds
+    const double buckets[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                              0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5};
+    const size_t bucket_count = sizeof(buckets) / sizeof(buckets[0]);
+
+    // The labels come from the request: keep their number bounded (routes
+    // of handle_request, anything else being "other")
+    const char* const routes[] = {
+        "session",
+        "user",
+        "note",
+        "search",
+        "changes",
+        "merkle",
+        "content",
+        "revision",
+    };
+
+    string route_label(const string& route)
+    {
+        foreach_(const char* r, routes)
+        {
+            if (route == r) return route;
+        }
+        return "other";
+    }
+
+    string method_label(const string& method)
+    {
+        if (method == "GET" || method == "POST" || method == "PUT" ||
+            method == "PATCH" || method == "DELETE")
+        {
+            return method;
+        }
+        return "other";
+    }
+
+    template <typename H>
+    void write_histogram(string& out, const string& name,
+                         const string& labels, const H& h)
+    {
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < bucket_count; ++i)
+        {
+            cumulative += h.counts[i];
+            fmt_to(out, "%1%_bucket{%2%,le=\"%3%\"} %4%\n", name, labels,
+                   buckets[i], cumulative);
+        }
+        fmt_to(out, "%1%_bucket{%2%,le=\"+Inf\"} %3%\n", name, labels, h.count);
+        fmt_to(out, "%1%_sum{%2%} %3%\n", name, labels, h.sum);
+        fmt_to(out, "%1%_count{%2%} %3%\n", name, labels, h.count);
+    }
+}
+
+RequestTimer::RequestTimer() : start_(chrono::steady_clock::now())
+{
+}
+
+void RequestTimer::phase(const char* name)
+{
+    auto now = chrono::steady_clock::now();
+    phases.push_back(make_pair(name,
+                               chrono::duration<double>(now - start_).count()));
+    start_ = now;
+}
+
+double RequestTimer::total() const
+{
+    double t = 0;
+    foreach_(const auto& p, phases) t += p.second;
+    return t;
+}
+
+Metrics::Histogram::Histogram() : counts(bucket_count + 1), sum(0), count(0)
+{
+}
+
+void Metrics::Histogram::observe(double seconds)
+{
+    size_t i = 0;
+    while (i < bucket_count && seconds > buckets[i]) ++i;
+    ++counts[i];
+    sum += seconds;
+    ++count;
+}
+
+void Metrics::record(const RequestTimer& timer)
+{
+    string route  = route_label(timer.route);
+    string method = method_label(timer.method);
+    lock_guard<mutex> lock(mutex_);
+    totals_[make_pair(route, method)].observe(timer.total());
+    foreach_(const auto& p, timer.phases)
+    {
+        phases_[Key(route, method, p.first)].observe(p.second);
+    }
+}
+
+string Metrics::prometheus()
+{
+    lock_guard<mutex> lock(mutex_);
+    string out;
+    out += "# HELP notera_request_seconds Time to serve API requests.\n"
+           "# TYPE notera_request_seconds histogram\n";
+    foreach_(const auto& t, totals_)
+    {
+        write_histogram(out, "notera_request_seconds",
+                        fmt("route=\"%1%\",method=\"%2%\"", t.first.first,
+                            t.first.second),
+                        t.second);
+    }
+    out += "# HELP notera_request_phase_seconds Time spent in each phase of "
+           "API requests.\n"
+           "# TYPE notera_request_phase_seconds histogram\n";
+    foreach_(const auto& p, phases_)
+    {
+        write_histogram(out, "notera_request_phase_seconds",
+                        fmt("route=\"%1%\",method=\"%2%\",phase=\"%3%\"",
+                            get<0>(p.first), get<1>(p.first),
+                            get<2>(p.first)),
+                        p.second);
+    }
+    return out;
+}
+
+void Metrics::append(const string& path, const RequestTimer& timer)
+{
+    // <time> <route> <method> <phase>=<seconds>... total=<seconds>
+    string line = fmt("%1% %2% %3%", time(NULL), route_label(timer.route),
+                      method_label(timer.method));
+    foreach_(const auto& p, timer.phases)
+    {
+        fmt_to(line, " %1%=%2%", p.first, p.second);
+    }
+    fmt_to(line, " total=%1%\n", timer.total());
+
+    // A single write, so that concurrent CGI processes don't mix lines
+    ofstream out(path, ios::app | ios::binary);
+    out.write(line.data(), line.size());
+}
@@ -0,0 +1,68 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Times the phases of a request (parsing, database work, output...) with a
+// monotonic clock. Each call to phase() ends the current phase and starts
+// the next one.
+class RequestTimer
+{
+public:
+    RequestTimer();
+
+    // The name must be a string literal
+    void phase(const char* name);
+
+    // Total time of the phases
+    double total() const;
+
+    // Route (p1 parameter) and method of the API call, for aggregation
+    std::string route;
+    std::string method;
+
+    std::vector<std::pair<const char*, double>> phases; // name, seconds
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Latency histograms of the requests served by the process, per route,
+// method and phase, exported in the Prometheus text format
+class Metrics
+{
+public:
+    void record(const RequestTimer& timer);
+    std::string prometheus();
+
+    // Appends the phase times of the request to a file, as one line (for
+    // CGI requests, which can't be aggregated in memory)
+    static void append(const std::string& path, const RequestTimer& timer);
+
+private:
+    class Histogram
+    {
+    public:
+        Histogram();
+        void observe(double seconds);
+
+        std::vector<uint64_t> counts; // per bucket, not cumulative
+        double                sum;
+        uint64_t              count;
+    };
+
+    typedef std::tuple<std::string, std::string, std::string> Key;
+
+    std::mutex                                               mutex_;
+    std::map<std::pair<std::string, std::string>, Histogram> totals_;
+    std::map<Key, Histogram>                                 phases_;
+};
+
+#endif
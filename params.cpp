@@ -0,0 +1,195 @@
+#include "params.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    bool is_special(char c)
+    {
+        return c == '&' || c == '=' || c == '%' || c == '+';
+    }
+
+    // Returns the first '&', '=', '%' or '+' in [p, end), or end
+    char* find_special(char* p, char* end)
+    {
+#ifdef __SSE2__
+        const __m128i amp   = _mm_set1_epi8('&');
+        const __m128i eq    = _mm_set1_epi8('=');
+        const __m128i pct   = _mm_set1_epi8('%');
+        const __m128i plus  = _mm_set1_epi8('+');
+        for (; end - p >= 16; p += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i*>(p));
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, eq)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask) return p + __builtin_ctz(mask);
+        }
+#endif
+        while (p < end && !is_special(*p)) ++p;
+        return p;
+    }
+
+    int hex_value(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+}
+
+void Env::add(string_view name, string_view value)
+{
+    vars_.push_back(make_pair(name, value));
+}
+
+void Env::set(string_view name, string value)
+{
+    // The deque does not move its elements, so the views stay valid
+    owned_.push_back(move(value));
+    string_view v = owned_.back();
+    for (auto& var : vars_)
+    {
+        if (var.first == name)
+        {
+            var.second = v;
+            return;
+        }
+    }
+    owned_.push_back(string(name));
+    vars_.push_back(make_pair(string_view(owned_.back()), v));
+}
+
+optional<string_view> Env::find(string_view name) const
+{
+    for (const auto& var : vars_)
+    {
+        if (var.first == name) return var.second;
+    }
+    return nullopt;
+}
+
+void Env::clear()
+{
+    vars_.clear();
+    owned_.clear();
+}
+
+string_view Params::operator[](string_view key) const
+{
+    string_view::size_type pos = 0;
+    string_view k, v, found;
+    while (next(pos, k, v))
+    {
+        if (k == key) found = v;
+    }
+    return found;
+}
+
+// Reads the pair at "pos" and moves past it. Empty items, and items without
+// a key or value, are skipped.
+bool Params::next(string_view::size_type& pos, string_view& key,
+                  string_view& value) const
+{
+    while (pos < s_.size())
+    {
+        auto end = s_.find_first_of(separators_, pos);
+        if (end == string_view::npos) end = s_.size();
+        string_view item = s_.substr(pos, end - pos);
+        pos = end + 1;
+
+        auto eq = item.find('=');
+        if (eq == string_view::npos || eq == 0 || eq + 1 == item.size())
+        {
+            continue;
+        }
+        key   = item.substr(0, eq);
+        value = item.substr(eq + 1);
+        return true;
+    }
+    return false;
+}
+
+// The decoded text is never longer than the encoded text, so it is written
+// over it: "r" reads the encoded text, "w" writes the decoded one.
+Form::Form(string& buf)
+{
+    char* r       = buf.data();
+    char* end     = r + buf.size();
+    char* w       = r;
+    char* key     = w;
+    char* key_end = NULL;
+
+    // Items without a key or '=' are skipped, but empty values are kept:
+    // "title=" sets an empty title
+    auto end_pair = [&]
+    {
+        if (key_end && key_end != key)
+        {
+            pairs_.emplace_back(string_view(key, key_end - key),
+                                string_view(key_end, w - key_end));
+        }
+        key     = w;
+        key_end = NULL;
+    };
+
+    while (r < end)
+    {
+        // Runs without special characters only need to be moved, and not
+        // even that before the first escape
+        char* s = find_special(r, end);
+        if (w != r) memmove(w, r, s - r);
+        w += s - r;
+        r  = s;
+        if (r == end) break;
+
+        char c = *r++;
+        switch (c)
+        {
+        case '+':
+            *w++ = ' ';
+            break;
+        case '%':
+        {
+            int hi = end - r >= 2 ? hex_value(r[0]) : -1;
+            int lo = hi >= 0 ? hex_value(r[1]) : -1;
+            if (lo >= 0)
+            {
+                *w++ = char(hi << 4 | lo);
+                r += 2;
+            }
+            else
+            {
+                *w++ = '%';
+            }
+            break;
+        }
+        case '=':
+            if (key_end) *w++ = '=';
+            else         key_end = w;
+            break;
+        case '&':
+            end_pair();
+            break;
+        }
+    }
+    end_pair();
+}
+
+string_view Form::operator[](string_view key) const
+{
+    string_view found;
+    for (const auto& p : pairs_)
+    {
+        if (p.first == key) found = p.second;
+    }
+    return found;
+}
@@ -0,0 +1,99 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// CGI environment variables, in a flat list. Values are views, either into
+// memory that outlives the Env (the process environment, the FastCGI params
+// buffer) or into copies owned by the Env.
+class Env
+{
+public:
+    Env() = default;
+    Env(Env&&) = default;
+    Env& operator=(Env&&) = default;
+    Env(const Env&) = delete;
+    Env& operator=(const Env&) = delete;
+
+    // Adds a variable referring to memory that must outlive the Env
+    void add(std::string_view name, std::string_view value);
+
+    // Sets a variable to a copy of the value
+    void set(std::string_view name, std::string value);
+
+    std::optional<std::string_view> find(std::string_view name) const;
+
+    // Returns the value of the variable, empty if it is not set
+    std::string_view operator[](std::string_view name) const
+    {
+        return find(name).value_or(std::string_view());
+    }
+
+    void clear();
+
+private:
+    std::vector<std::pair<std::string_view, std::string_view>> vars_;
+    std::deque<std::string>                                    owned_;
+};
+
+// Parameters of a query string, form body or cookie header: key=value pairs
+// separated by any of the separator characters. Nothing is parsed or copied
+// up front; each lookup scans the string in place.
+class Params
+{
+public:
+    Params(std::string_view s, std::string_view separators)
+        : s_(s), separators_(separators)
+    {
+    }
+
+    // Returns the value of the last pair with this key, empty if none
+    std::string_view operator[](std::string_view key) const;
+
+    // Calls f(key, value) for each pair, in order
+    template <typename F>
+    void for_each(F f) const
+    {
+        std::string_view::size_type pos = 0;
+        std::string_view key, value;
+        while (next(pos, key, value)) f(key, value);
+    }
+
+private:
+    bool next(std::string_view::size_type& pos, std::string_view& key,
+              std::string_view& value) const;
+
+    std::string_view s_;
+    std::string_view separators_;
+};
+
+// Parameters of an application/x-www-form-urlencoded string (form body or
+// query string), decoded in place: '+' becomes a space and %XX escapes are
+// replaced by their byte. The buffer is overwritten with the decoded keys
+// and values, which the views point into. Unlike in Params, pairs with an
+// empty value ("key=") are kept.
+class Form
+{
+public:
+    explicit Form(std::string& buf);
+
+    // Returns the value of the last pair with this key, empty if none
+    std::string_view operator[](std::string_view key) const;
+
+    // Calls f(key, value) for each pair, in order
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (const auto& p : pairs_) f(p.first, p.second);
+    }
+
+private:
+    std::vector<std::pair<std::string_view, std::string_view>> pairs_;
+};
+
+#endif
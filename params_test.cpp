@@ -0,0 +1,80 @@
+// Tests of the parameter parsers: prints the failed checks, and exits with
+// a non-zero status if there are any.
+
+#include "params.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    int failures = 0;
+
+    void expect(bool cond, const string& what)
+    {
+        if (cond) return;
+        cout << "FAILED: " << what << endl;
+        ++failures;
+    }
+
+    typedef vector<pair<string, string>> Pairs;
+
+    Pairs form_pairs(string buf)
+    {
+        Pairs pairs;
+        Form form(buf);
+        form.for_each([&pairs](string_view key, string_view value)
+        {
+            pairs.emplace_back(key, value);
+        });
+        return pairs;
+    }
+
+    void test_form()
+    {
+        expect(form_pairs("a=1&b=2") == Pairs{{"a", "1"}, {"b", "2"}},
+               "Form splits pairs");
+        expect(form_pairs("t=a+b%2Cc%3D%26&x=%zz%4") ==
+                   Pairs{{"t", "a b,c=&"}, {"x", "%zz%4"}},
+               "Form decodes '+' and escapes, and keeps invalid escapes");
+        expect(form_pairs("k=a=b") == Pairs{{"k", "a=b"}},
+               "Form keeps '=' in values");
+
+        // An empty value is a value: PATCH /note/<id> with "title=" clears
+        // the title, and only leaves it alone if it is omitted
+        expect(form_pairs("version=3&title=&splice=0,0,x") ==
+                   Pairs{{"version", "3"}, {"title", ""},
+                         {"splice", "0,0,x"}},
+               "Form keeps pairs with an empty value");
+        expect(form_pairs("&&=1&novalue&title=") == Pairs{{"title", ""}},
+               "Form skips empty items, and items without a key or '='");
+
+        string buf = "a=1&a=";
+        Form form(buf);
+        expect(form["a"].empty() && form["a"].data() != NULL,
+               "Form lookup returns the last pair, even if empty");
+        expect(form["b"].data() == NULL, "Form lookup of a missing key");
+    }
+
+    void test_params()
+    {
+        Params cookies("sid=12; st=abc; empty=", "; ,");
+        expect(cookies["sid"] == "12" && cookies["st"] == "abc",
+               "Params splits on any separator");
+        expect(cookies["empty"].empty(), "Params skips empty values");
+    }
+}
+
+int main()
+{
+    test_form();
+    test_params();
+    if (failures) return 1;
+    cout << "params_test: OK" << endl;
+    return 0;
+}
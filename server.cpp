@@ -0,0 +1,278 @@
+// Standalone HTTP server for notera, replacing server.py on Linux.
+//
+// Serves the static files of the document root, and calls the API request
+// handler in-process for the API script path (.../cgi-bin/api[.exe]), so no
+// process is forked per request. API calls run on a pool of worker threads,
+// each with its own database connection. Usage:
+//
+//     server [--host HOST] [--port PORT] [--root DIR] [--db FILE]
+//            [--threads N] [--processes N] [--sessions table|tokens]
+//
+// The defaults mimic server.py: port 8000, with the parent directory as the
+// document root so that the app is served under /notera/. By default, one
+// worker thread per core is started. Sessions are cached in memory, unless
+// several processes are started. With "--sessions tokens", authenticated
+// sessions are carried by signed cookies (see session_tokens.h); as logouts
+// are only known to the process that served them, this requires a single
+// process.
+//
+// Latency histograms of the API calls, per route, method and phase, are
+// served at /metrics in the Prometheus text format. Each process keeps its
+// own.
+//
+// As for the API executable, NOTERA_REVISION_CHAIN sets the maximum number
+// of deltas between snapshots in the revision history (16 by default).
+
+#include "db.h"
+#include "handler.h"
+#include "http_server.h"
+#include "log_writer.h"
+#include "metrics.h"
+#include "session_cache.h"
+#include "session_tokens.h"
+#include "util.h"
+#include "worker_pool.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace
+{
+    class Options
+    {
+    public:
+        Options()
+            : port("8000"), root(".."), db_path("db.sqlite3"), threads(0),
+              processes(1), session_tokens(false)
+        {
+        }
+
+        string host;
+        string port;
+        string root;
+        string db_path;
+        long   threads;
+        long   processes;
+        bool   session_tokens;
+    };
+
+    bool ends_with(const string& s, const string& suffix)
+    {
+        return s.size() >= suffix.size() &&
+               s.compare(s.size() - suffix.size(), string::npos, suffix) == 0;
+    }
+
+    string content_type(const string& path)
+    {
+        if (ends_with(path, ".html")) return "text/html";
+        if (ends_with(path, ".js"))   return "application/javascript";
+        if (ends_with(path, ".css"))  return "text/css";
+        if (ends_with(path, ".png"))  return "image/png";
+        if (ends_with(path, ".json")) return "application/json";
+        return "application/octet-stream";
+    }
+
+    // Converts an HTTP request to the CGI request expected by the handler
+    void to_cgi(const HttpRequest& http, const string& script,
+                const string& query, const Options& opt, Request& req)
+    {
+        // The HTTP request does not outlive the call: values are copied
+        auto& env = req.env;
+        env.add("GATEWAY_INTERFACE", "CGI/1.1");
+        env.add("SERVER_SOFTWARE",   "notera");
+        env.set("SERVER_PROTOCOL",   http.version);
+        env.set("SERVER_PORT",       opt.port);
+        env.set("REQUEST_METHOD",    http.method);
+        env.set("REQUEST_URI",       http.target);
+        env.set("SCRIPT_NAME",       script);
+        env.set("QUERY_STRING",      query);
+        env.set("REMOTE_ADDR",       http.remote_addr);
+        env.set("REMOTE_PORT",       fmt("%1%", http.remote_port));
+        env.set("CONTENT_LENGTH",    fmt("%1%", http.body.size()));
+        foreach_(const auto& h, http.headers)
+        {
+            if (h.first == "content-length") continue;
+            if (h.first == "content-type")
+            {
+                env.set("CONTENT_TYPE", h.second);
+                continue;
+            }
+            string name = "HTTP_";
+            foreach_(char ch, h.first) name += ch == '-' ? '_' : toupper(ch);
+            auto prev = env.find(name);
+            env.set(name, prev ? string(*prev) + ", " + h.second : h.second);
+        }
+        req.body = http.body;
+    }
+
+    void serve_file(const HttpRequest& http, const string& path,
+                    const Options& opt, HttpResponse& resp)
+    {
+        struct stat st;
+        string file = opt.root + path;
+        if (path.find("..") != string::npos ||
+            stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            resp.status = 404;
+            resp.reason = "Not Found";
+            return;
+        }
+        if (http.method != "GET" && http.method != "HEAD")
+        {
+            resp.status = 405;
+            resp.reason = "Method Not Allowed";
+            return;
+        }
+        resp.headers.push_back("Content-Type: " + content_type(path));
+        resp.body = get_file_contents(file);
+    }
+
+    void serve(WorkerPool& pool, SessionTokens* tokens, Metrics& metrics,
+               const Options& opt, const HttpRequest& http,
+               const HttpServer::Reply& reply)
+    {
+        string path  = http.target;
+        string query;
+        string::size_type q = path.find('?');
+        if (q != string::npos)
+        {
+            query = path.substr(q + 1);
+            path.resize(q);
+        }
+
+        if (path == "/metrics")
+        {
+            HttpResponse resp;
+            resp.headers.push_back("Content-Type: text/plain; version=0.0.4");
+            resp.body = metrics.prometheus();
+            reply(resp);
+            return;
+        }
+
+        if (!ends_with(path, "/cgi-bin/api.exe") &&
+            !ends_with(path, "/cgi-bin/api"))
+        {
+            HttpResponse resp;
+            serve_file(http, path, opt, resp);
+            reply(resp);
+            return;
+        }
+
+        shared_ptr<Request> req(new Request);
+        to_cgi(http, path, query, opt, *req);
+        pool.submit([req, reply, tokens, &metrics](DB& db)
+        {
+            req->timer.phase("queue");
+            HttpResponse resp;
+            try
+            {
+                Resp api_resp;
+                handle_request(db, *req, api_resp, tokens);
+
+                resp.status = api_resp.status();
+                resp.reason = api_resp.reason();
+                resp.headers.push_back("Content-Type: " +
+                                       api_resp.content_type());
+                foreach_(const auto& h, api_resp.get_headers())
+                {
+                    resp.headers.push_back(h);
+                }
+                resp.body = move(api_resp.body());
+            }
+            catch (const std::exception& ex)
+            {
+                // The reply is still owed to the connection
+                resp        = HttpResponse();
+                resp.status = 500;
+                resp.reason = "Internal Server Error";
+                resp.body   = ex.what();
+            }
+            req->timer.phase("emit");
+            metrics.record(req->timer);
+            reply(resp);
+        });
+    }
+
+    Options parse_options(int argc, char* argv[])
+    {
+        Options opt;
+        for (int i = 1; i < argc; ++i)
+        {
+            string arg(argv[i]);
+            CHECK(i + 1 < argc, "Missing value for option %1%", arg);
+            string value(argv[++i]);
+            if      (arg == "--host")      opt.host      = value;
+            else if (arg == "--port")      opt.port      = value;
+            else if (arg == "--root")      opt.root      = value;
+            else if (arg == "--db")        opt.db_path   = value;
+            else if (arg == "--threads")   opt.threads   = atol(value.c_str());
+            else if (arg == "--processes") opt.processes = atol(value.c_str());
+            else if (arg == "--sessions")
+            {
+                CHECK(value == "table" || value == "tokens",
+                      "Invalid session mode %1%", value);
+                opt.session_tokens = value == "tokens";
+            }
+            else CHECK(false, "Unknown option %1%", arg);
+        }
+        CHECK(opt.threads >= 0, "Invalid number of threads");
+        CHECK(opt.processes > 0, "Invalid number of processes");
+        CHECK(!opt.session_tokens || opt.processes == 1,
+              "Session tokens require a single process");
+        return opt;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Options opt = parse_options(argc, argv);
+
+        // Each process has its own listening socket (SO_REUSEPORT lets the
+        // kernel balance connections between them) and its own workers
+        for (long i = 1; i < opt.processes; ++i)
+        {
+            if (fork() == 0) break;
+        }
+
+        // Declared first, so that the workers stop logging before it is
+        // flushed and destroyed
+        LogWriter log_writer(opt.db_path);
+        unique_ptr<SessionCache> session_cache;
+        if (opt.processes == 1)
+        {
+            session_cache.reset(new SessionCache(opt.db_path));
+        }
+        unique_ptr<SessionTokens> tokens;
+        if (opt.session_tokens)
+        {
+            tokens.reset(new SessionTokens(
+                DB(opt.db_path).get_secret("session_token_key")));
+        }
+        Metrics metrics;
+        WorkerPool pool(opt.threads, opt.db_path, &log_writer,
+                        session_cache.get());
+        HttpServer server(opt.host, opt.port,
+                          [&](HttpRequest& req, const HttpServer::Reply& reply)
+                          {
+                              serve(pool, tokens.get(), metrics, opt, req,
+                                    reply);
+                          });
+        server.run();
+    }
+    catch (const std::exception& ex)
+    {
+        cerr << ex.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
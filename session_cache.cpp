@@ -0,0 +1,95 @@
+#include "session_cache.h"
+#include "util.h"
+
+#include <iostream>
+
+using namespace std;
+
+SessionCache::SessionCache(const string& db_path,
+                           chrono::seconds reap_interval)
+    : db_(db_path), reap_interval_(reap_interval), stop_(false),
+      thread_([this] { run(); })
+{
+}
+
+SessionCache::~SessionCache()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+}
+
+optional<Session> SessionCache::get(string_view sid)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = sessions_.find(string(sid));
+    if (it == sessions_.end()) return nullopt;
+    Session ses = it->second.ses;
+    ses.age = time(NULL) - it->second.create_time;
+    if (ses.age >= max_session_age) return nullopt;
+    return ses;
+}
+
+void SessionCache::put(string_view sid, const Session& ses)
+{
+    Entry e;
+    e.ses         = ses;
+    e.create_time = time(NULL) - ses.age;
+    lock_guard<mutex> lock(mutex_);
+    sessions_[string(sid)] = move(e);
+}
+
+void SessionCache::set_auth(string_view sid)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = sessions_.find(string(sid));
+    if (it != sessions_.end()) it->second.ses.auth = 1;
+}
+
+void SessionCache::erase(string_view sid)
+{
+    lock_guard<mutex> lock(mutex_);
+    sessions_.erase(string(sid));
+}
+
+void SessionCache::run()
+{
+    for (;;)
+    {
+        {
+            unique_lock<mutex> lock(mutex_);
+            if (cond_.wait_for(lock, reap_interval_, [this] { return stop_; }))
+            {
+                return;
+            }
+        }
+        try
+        {
+            reap();
+        }
+        catch (const std::exception& ex)
+        {
+            cerr << "Can't delete expired sessions: " << ex.what() << endl;
+        }
+    }
+}
+
+void SessionCache::reap()
+{
+    time_t oldest = time(NULL) - max_session_age;
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (auto it = sessions_.begin(); it != sessions_.end();)
+        {
+            if (it->second.create_time <= oldest) it = sessions_.erase(it);
+            else                                  ++it;
+        }
+    }
+
+    // Also covers the sessions that were never loaded in the cache
+    db_.db_.execute("DELETE FROM session WHERE create_time <= ?",
+                    int64_t(oldest));
+}
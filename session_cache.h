@@ -0,0 +1,59 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include "db.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+// In-process copy of the session table, shared by the connections of a
+// persistent process so that requests don't have to query it. The DB
+// methods that change sessions write through to it. Sessions expire
+// max_session_age after their creation; a reaper thread, with its own
+// connection, periodically evicts the expired ones and deletes their rows.
+//
+// As it is not told about changes made by other processes, the cache must
+// only be used when a single process serves the database.
+class SessionCache
+{
+public:
+    SessionCache(const std::string& db_path,
+                 std::chrono::seconds reap_interval =
+                     std::chrono::seconds(60));
+    ~SessionCache();
+
+    // Returns the session, or nothing if it is unknown or expired
+    std::optional<Session> get(std::string_view sid);
+
+    void put(std::string_view sid, const Session& ses);
+    void set_auth(std::string_view sid);
+    void erase(std::string_view sid);
+
+private:
+    class Entry
+    {
+    public:
+        Session     ses;
+        std::time_t create_time;
+    };
+
+    void run();
+    void reap();
+
+    DB                                     db_;
+    std::chrono::seconds                   reap_interval_;
+    std::mutex                             mutex_;
+    std::condition_variable                cond_;
+    std::unordered_map<std::string, Entry> sessions_;
+    bool                                   stop_;
+    std::thread                            thread_;
+};
+
+#endif
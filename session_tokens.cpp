@@ -0,0 +1,162 @@
+#include "session_tokens.h"
+#include "sha1.h"
+#include "util.h"
+
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    const size_t block_size = 64;
+
+    string digest_bytes(const Sha1& sha)
+    {
+        string d;
+        foreach_(unsigned w, sha.Message_Digest)
+        {
+            for (int shift = 24; shift >= 0; shift -= 8) d += char(w >> shift);
+        }
+        return d;
+    }
+
+    string to_hex(const string& s)
+    {
+        static const char digits[] = "0123456789abcdef";
+        string hex;
+        foreach_(unsigned char c, s)
+        {
+            hex += digits[c >> 4];
+            hex += digits[c & 0xf];
+        }
+        return hex;
+    }
+
+    optional<string> from_hex(const string& hex)
+    {
+        if (hex.size() % 2) return nullopt;
+        string s;
+        for (size_t i = 0; i < hex.size(); i += 2)
+        {
+            char* end;
+            string byte = hex.substr(i, 2);
+            long c = strtol(byte.c_str(), &end, 16);
+            if (*end) return nullopt;
+            s += char(c);
+        }
+        return s;
+    }
+
+    // Compares in constant time, not to leak how much of a MAC is right
+    bool equal(const string& a, const string& b)
+    {
+        if (a.size() != b.size()) return false;
+        unsigned char diff = 0;
+        for (size_t i = 0; i < a.size(); ++i) diff |= a[i] ^ b[i];
+        return diff == 0;
+    }
+}
+
+SessionTokens::SessionTokens(const string& key) : key_(key)
+{
+    if (key_.size() > block_size)
+    {
+        Sha1 sha(key_);
+        sha.result();
+        key_ = digest_bytes(sha);
+    }
+    key_.resize(block_size, '\0');
+}
+
+string SessionTokens::issue(string_view sid, const Session& ses)
+{
+    string payload = fmt("%1%.%2%.%3%.%4%", sid,
+                         time(NULL) + max_session_age - ses.age, ses.auth,
+                         to_hex(ses.user));
+    return payload + "." + sign(payload);
+}
+
+optional<Session> SessionTokens::verify(string_view token, string_view sid)
+{
+    auto t = parse(token);
+    if (!t || t->sid != sid || !equal(t->mac, sign(t->payload)))
+    {
+        return nullopt;
+    }
+
+    time_t now = time(NULL);
+    if (t->expiry <= now) return nullopt;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (revoked_.count(t->mac)) return nullopt;
+    }
+
+    Session ses;
+    ses.user = t->user;
+    ses.auth = t->auth;
+    ses.age  = max_session_age - (t->expiry - now);
+    return ses;
+}
+
+void SessionTokens::revoke(string_view token)
+{
+    auto t = parse(token);
+    if (!t) return;
+
+    time_t now = time(NULL);
+    lock_guard<mutex> lock(mutex_);
+    for (auto it = revoked_.begin(); it != revoked_.end();)
+    {
+        if (it->second <= now) it = revoked_.erase(it);
+        else                   ++it;
+    }
+    if (t->expiry > now) revoked_[t->mac] = t->expiry;
+}
+
+// Token format: <sid>.<expiry>.<auth>.<hex user>.<hex MAC>
+optional<SessionTokens::Token> SessionTokens::parse(string_view token) const
+{
+    vector<string> fields;
+    string_view::size_type start = 0;
+    for (;;)
+    {
+        string_view::size_type dot = token.find('.', start);
+        fields.emplace_back(token.substr(start, dot - start));
+        if (dot == string_view::npos) break;
+        start = dot + 1;
+    }
+    if (fields.size() != 5) return nullopt;
+
+    auto user = from_hex(fields[3]);
+    if (!user) return nullopt;
+
+    Token t;
+    t.payload = token.substr(0, token.rfind('.'));
+    t.mac     = fields[4];
+    t.sid     = fields[0];
+    t.expiry  = atol(fields[1].c_str());
+    t.auth    = atol(fields[2].c_str());
+    t.user    = *user;
+    return t;
+}
+
+// HMAC-SHA1 (RFC 2104) of the payload, in hexadecimal
+string SessionTokens::sign(const string& payload) const
+{
+    string ipad(key_);
+    string opad(key_);
+    for (size_t i = 0; i < block_size; ++i)
+    {
+        ipad[i] ^= 0x36;
+        opad[i] ^= 0x5c;
+    }
+
+    Sha1 inner(ipad);
+    inner.update(payload);
+    inner.result();
+    Sha1 outer(opad);
+    outer.update(digest_bytes(inner));
+    outer.result();
+    return to_hex(digest_bytes(outer));
+}
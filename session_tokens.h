@@ -0,0 +1,53 @@
+#ifndef SESSION_TOKENS_H
+#define SESSION_TOKENS_H
+
+#include "db.h"
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Stateless alternative to the session table for authenticated sessions. On
+// login, the client gets a token holding its session ID, user, auth flag
+// and expiry, signed with HMAC-SHA1, so checking it needs no database
+// access. Tokens revoked by a logout are remembered in memory until they
+// expire; the revocation list is per process.
+class SessionTokens
+{
+public:
+    explicit SessionTokens(const std::string& key);
+
+    // Returns a token for the session, expiring with it
+    std::string issue(std::string_view sid, const Session& ses);
+
+    // Returns the session held by the token, if it is correctly signed, for
+    // the given session ID, and neither expired nor revoked
+    std::optional<Session> verify(std::string_view token,
+                                  std::string_view sid);
+
+    void revoke(std::string_view token);
+
+private:
+    class Token
+    {
+    public:
+        std::string payload;
+        std::string mac;
+        std::string sid;
+        std::time_t expiry;
+        long        auth;
+        std::string user;
+    };
+
+    std::optional<Token> parse(std::string_view token) const;
+    std::string sign(const std::string& payload) const;
+
+    std::string                        key_;
+    std::mutex                         mutex_;
+    std::map<std::string, std::time_t> revoked_; // MAC => expiry
+};
+
+#endif
@@ -29,6 +29,17 @@
  *      arrays assume that only 8 bits of information are stored in each
  *      character.
  *
+ *  Implementation:
+ *      Whole 64-byte blocks are compressed directly from the input; only
+ *      the partial block at the end of each update is buffered. Blocks
+ *      are compressed with the x86 SHA extensions when the processor
+ *      has them (checked once, with CPUID), or else with a portable
+ *      implementation that keeps only 16 words of message schedule.
+ *
+ *      Sha1Batch runs the same rounds on 8 messages at once, with each
+ *      word of the state and message schedule in an AVX2 register of
+ *      8 lanes.
+ *
  *  Caveats:
  *      SHA-1 is designed to work with messages less than 2^64 bits
  *      long. Although SHA-1 allows a message digest to be generated for
@@ -40,12 +51,506 @@
 
 #include "sha1.h"
 
-#define SHA1CircularShift(bits,word) \
-                ((((word) << (bits)) & 0xFFFFFFFF) | \
-                ((word) >> (32-(bits))))
+#include <algorithm>
+#include <cstring>
+
+// SHA1_PORTABLE leaves out the x86 code paths (for the tests of the
+// portable ones)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(SHA1_PORTABLE)
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+namespace
+{
+    // Compresses "blocks" 64-byte blocks of data into the state
+    typedef void (*Compress)(unsigned* state, const unsigned char* data,
+                             size_t blocks);
+
+    inline unsigned rotl(unsigned word, int bits)
+    {
+        return (word << bits) | (word >> (32 - bits));
+    }
+
+    inline unsigned load_be32(const unsigned char* p)
+    {
+        return (unsigned(p[0]) << 24) | (unsigned(p[1]) << 16) |
+               (unsigned(p[2]) << 8)  |  unsigned(p[3]);
+    }
+
+    void compress_portable(unsigned* state, const unsigned char* data,
+                           size_t blocks)
+    {
+        for (; blocks; --blocks, data += 64)
+        {
+            // The message schedule is computed as it is consumed, in a
+            // circular buffer of 16 words
+            unsigned W[16];
+            for (int t = 0; t < 16; ++t) W[t] = load_be32(data + t * 4);
+
+            unsigned A = state[0];
+            unsigned B = state[1];
+            unsigned C = state[2];
+            unsigned D = state[3];
+            unsigned E = state[4];
+
+#define SHA1_ROUND(t, f, k)                                                 \
+            {                                                               \
+                if (t >= 16)                                                \
+                {                                                           \
+                    W[t & 15] = rotl(W[(t + 13) & 15] ^ W[(t + 8) & 15] ^   \
+                                     W[(t + 2) & 15] ^ W[t & 15], 1);       \
+                }                                                           \
+                unsigned temp = rotl(A, 5) + (f) + E + W[t & 15] + k;       \
+                E = D;                                                      \
+                D = C;                                                      \
+                C = rotl(B, 30);                                            \
+                B = A;                                                      \
+                A = temp;                                                   \
+            }
+
+            for (int t = 0; t < 20; ++t)
+            {
+                SHA1_ROUND(t, D ^ (B & (C ^ D)), 0x5A827999)
+            }
+            for (int t = 20; t < 40; ++t)
+            {
+                SHA1_ROUND(t, B ^ C ^ D, 0x6ED9EBA1)
+            }
+            for (int t = 40; t < 60; ++t)
+            {
+                SHA1_ROUND(t, (B & C) | (D & (B | C)), 0x8F1BBCDC)
+            }
+            for (int t = 60; t < 80; ++t)
+            {
+                SHA1_ROUND(t, B ^ C ^ D, 0xCA62C1D6)
+            }
+#undef SHA1_ROUND
+
+            state[0] += A;
+            state[1] += B;
+            state[2] += C;
+            state[3] += D;
+            state[4] += E;
+        }
+    }
+
+#ifdef SHA1_X86
+#define SHA1_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+    // Rounds 4K to 4K + 3 with the SHA extensions. The message words are
+    // in msg[K % 4] (the next ones being computed in the other registers),
+    // and E alternates between e[0] and e[1].
+    template <int K>
+    SHA1_TARGET __attribute__((always_inline)) inline
+    void rounds4(__m128i& abcd, __m128i (&e)[2], __m128i (&msg)[4],
+                 const unsigned char* data, __m128i mask)
+    {
+        const int m = K % 4;
+        if constexpr (K < 4)
+        {
+            msg[m] = _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(data +
+                                                                 16 * K)),
+                mask);
+        }
+        if constexpr (K == 0) e[0] = _mm_add_epi32(e[0], msg[0]);
+        else e[K % 2] = _mm_sha1nexte_epu32(e[K % 2], msg[m]);
+        e[(K + 1) % 2] = abcd;
+        if constexpr (K >= 3 && K <= 18)
+        {
+            msg[(m + 1) % 4] = _mm_sha1msg2_epu32(msg[(m + 1) % 4], msg[m]);
+        }
+        abcd = _mm_sha1rnds4_epu32(abcd, e[K % 2], K / 5);
+        if constexpr (K >= 1 && K <= 16)
+        {
+            msg[(m + 3) % 4] = _mm_sha1msg1_epu32(msg[(m + 3) % 4], msg[m]);
+        }
+        if constexpr (K >= 2 && K <= 17)
+        {
+            msg[(m + 2) % 4] = _mm_xor_si128(msg[(m + 2) % 4], msg[m]);
+        }
+    }
+
+    SHA1_TARGET
+    void compress_shani(unsigned* state, const unsigned char* data,
+                        size_t blocks)
+    {
+        // Big-endian words, and A in the highest lane
+        const __m128i mask = _mm_set_epi64x(0x0001020304050607LL,
+                                            0x08090a0b0c0d0e0fLL);
+        __m128i abcd = _mm_shuffle_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+        __m128i e0   = _mm_set_epi32(state[4], 0, 0, 0);
+
+        for (; blocks; --blocks, data += 64)
+        {
+            __m128i abcd_save = abcd;
+            __m128i e[2]      = {e0, e0};
+            __m128i msg[4];
+
+            rounds4<0>(abcd, e, msg, data, mask);
+            rounds4<1>(abcd, e, msg, data, mask);
+            rounds4<2>(abcd, e, msg, data, mask);
+            rounds4<3>(abcd, e, msg, data, mask);
+            rounds4<4>(abcd, e, msg, data, mask);
+            rounds4<5>(abcd, e, msg, data, mask);
+            rounds4<6>(abcd, e, msg, data, mask);
+            rounds4<7>(abcd, e, msg, data, mask);
+            rounds4<8>(abcd, e, msg, data, mask);
+            rounds4<9>(abcd, e, msg, data, mask);
+            rounds4<10>(abcd, e, msg, data, mask);
+            rounds4<11>(abcd, e, msg, data, mask);
+            rounds4<12>(abcd, e, msg, data, mask);
+            rounds4<13>(abcd, e, msg, data, mask);
+            rounds4<14>(abcd, e, msg, data, mask);
+            rounds4<15>(abcd, e, msg, data, mask);
+            rounds4<16>(abcd, e, msg, data, mask);
+            rounds4<17>(abcd, e, msg, data, mask);
+            rounds4<18>(abcd, e, msg, data, mask);
+            rounds4<19>(abcd, e, msg, data, mask);
+
+            // e[0] holds the E used by the last rounds' successor
+            e0   = _mm_sha1nexte_epu32(e[0], e0);
+            abcd = _mm_add_epi32(abcd, abcd_save);
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state),
+                         _mm_shuffle_epi32(abcd, 0x1B));
+        state[4] = _mm_extract_epi32(e0, 3);
+    }
+
+    bool has_sha_extensions()
+    {
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+        bool ssse3  = ecx & (1 << 9);
+        bool sse4_1 = ecx & (1 << 19);
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+        bool sha    = ebx & (1 << 29);
+        return ssse3 && sse4_1 && sha;
+    }
+
+    // Checks a compression function against the one-block message "abc"
+    // (FIPS 180 example)
+    bool known_answer(Compress compress)
+    {
+        static const unsigned expected[5] = {0xA9993E36, 0x4706816A,
+                                             0xBA3E2571, 0x7850C26C,
+                                             0x9CD0D89D};
+        unsigned char block[64] = {'a', 'b', 'c', 0x80};
+        block[63] = 24;
+        unsigned state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                             0x10325476, 0xC3D2E1F0};
+        compress(state, block, 1);
+        return memcmp(state, expected, sizeof(state)) == 0;
+    }
+#endif
+
+    Compress select_compress()
+    {
+#ifdef SHA1_X86
+        if (has_sha_extensions() && known_answer(compress_shani))
+        {
+            return compress_shani;
+        }
+#endif
+        return compress_portable;
+    }
+
+    Compress selected_compress()
+    {
+        static const Compress f = select_compress();
+        return f;
+    }
+
+    void compress(unsigned* state, const unsigned char* data, size_t blocks)
+    {
+        selected_compress()(state, data, blocks);
+    }
+}
+
+namespace
+{
+    // Message assigned to a lane of a batch: its whole blocks are read in
+    // place, and the last one or two blocks, with the padding, from "tail"
+    class Lane
+    {
+    public:
+        void start(std::string_view m, size_t i)
+        {
+            index  = i;
+            data   = reinterpret_cast<const unsigned char*>(m.data());
+            blocks = m.size() / 64;
+
+            size_t rest = m.size() % 64;
+            tail_blocks = rest < 56 ? 1 : 2;
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, data + blocks * 64, rest);
+            tail[rest] = 0x80;
+            uint64_t bits = uint64_t(m.size()) * 8;
+            unsigned char* end = tail + tail_blocks * 64;
+            for (int b = 1; b <= 8; ++b, bits >>= 8) end[-b] = bits & 0xFF;
+            next_tail = tail;
+        }
+
+        // Returns the next block, and whether it is the last one
+        const unsigned char* next(bool& last)
+        {
+            const unsigned char* block;
+            if (blocks)
+            {
+                block = data;
+                data += 64;
+                --blocks;
+            }
+            else
+            {
+                block = next_tail;
+                next_tail += 64;
+                --tail_blocks;
+            }
+            last = !blocks && !tail_blocks;
+            return block;
+        }
+
+        size_t               index;
+        const unsigned char* data;
+        size_t               blocks;
+        unsigned char        tail[128];
+        const unsigned char* next_tail;
+        size_t               tail_blocks;
+    };
+
+    const unsigned initial_state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                                       0x10325476, 0xC3D2E1F0};
+
+#ifdef SHA1_X86
+#define SHA1_AVX2 __attribute__((target("avx2")))
+
+    template <int N>
+    SHA1_AVX2 __attribute__((always_inline)) inline
+    __m256i rotl8(__m256i x)
+    {
+        return _mm256_or_si256(_mm256_slli_epi32(x, N),
+                               _mm256_srli_epi32(x, 32 - N));
+    }
+
+    // Loads word t of the 8 blocks: the 8x8 word matrices of each half of
+    // the blocks are transposed, and the words converted from big-endian
+    SHA1_AVX2
+    void load_schedule8(const unsigned char* const* blocks, __m256i* W)
+    {
+        const __m256i bswap = _mm256_set_epi8(
+            12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+            12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+        for (int h = 0; h < 2; ++h)
+        {
+            __m256i r[8];
+            for (int j = 0; j < 8; ++j)
+            {
+                r[j] = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(blocks[j] + 32 * h));
+            }
+            __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+            __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+            __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+            __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+            __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+            __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+            __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+            __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+            __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+            __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+            __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+            __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+            __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+            __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+            __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+            __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+            __m256i* w = W + 8 * h;
+            w[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+            w[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+            w[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+            w[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+            w[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+            w[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+            w[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+            w[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+            for (int k = 0; k < 8; ++k) w[k] = _mm256_shuffle_epi8(w[k], bswap);
+        }
+    }
+
+    // Compresses one block per lane: state[i][j] is word i of the state of
+    // lane j
+    SHA1_AVX2
+    void compress8(unsigned (*state)[8], const unsigned char* const* blocks)
+    {
+        __m256i W[16];
+        load_schedule8(blocks, W);
+
+        __m256i S[5];
+        for (int i = 0; i < 5; ++i)
+        {
+            S[i] = _mm256_loadu_si256(reinterpret_cast<__m256i*>(state[i]));
+        }
+        __m256i A = S[0];
+        __m256i B = S[1];
+        __m256i C = S[2];
+        __m256i D = S[3];
+        __m256i E = S[4];
+
+#define SHA1_ROUND8(t, f, k)                                                \
+        {                                                                   \
+            if (t >= 16)                                                    \
+            {                                                               \
+                W[t & 15] = rotl8<1>(_mm256_xor_si256(                      \
+                    _mm256_xor_si256(W[(t + 13) & 15], W[(t + 8) & 15]),    \
+                    _mm256_xor_si256(W[(t + 2) & 15], W[t & 15])));         \
+            }                                                               \
+            __m256i temp = _mm256_add_epi32(                                \
+                _mm256_add_epi32(rotl8<5>(A), f),                           \
+                _mm256_add_epi32(_mm256_add_epi32(E, W[t & 15]),            \
+                                 _mm256_set1_epi32(k)));                    \
+            E = D;                                                          \
+            D = C;                                                          \
+            C = rotl8<30>(B);                                               \
+            B = A;                                                          \
+            A = temp;                                                       \
+        }
+
+        for (int t = 0; t < 20; ++t)
+        {
+            SHA1_ROUND8(t, _mm256_xor_si256(D, _mm256_and_si256(
+                               B, _mm256_xor_si256(C, D))), 0x5A827999)
+        }
+        for (int t = 20; t < 40; ++t)
+        {
+            SHA1_ROUND8(t, _mm256_xor_si256(_mm256_xor_si256(B, C), D),
+                        0x6ED9EBA1)
+        }
+        for (int t = 40; t < 60; ++t)
+        {
+            SHA1_ROUND8(t, _mm256_or_si256(_mm256_and_si256(B, C),
+                               _mm256_and_si256(D, _mm256_or_si256(B, C))),
+                        int(0x8F1BBCDC))
+        }
+        for (int t = 60; t < 80; ++t)
+        {
+            SHA1_ROUND8(t, _mm256_xor_si256(_mm256_xor_si256(B, C), D),
+                        int(0xCA62C1D6))
+        }
+#undef SHA1_ROUND8
+
+        S[0] = _mm256_add_epi32(S[0], A);
+        S[1] = _mm256_add_epi32(S[1], B);
+        S[2] = _mm256_add_epi32(S[2], C);
+        S[3] = _mm256_add_epi32(S[3], D);
+        S[4] = _mm256_add_epi32(S[4], E);
+        for (int i = 0; i < 5; ++i)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[i]), S[i]);
+        }
+    }
+
+    bool has_avx2()
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+
+    void hash8(const vector<string_view>& messages,
+               vector<Sha1Batch::Digest>& digests)
+    {
+        static const unsigned char idle_block[64] = {};
+        unsigned             state[5][8];
+        Lane                 lanes[8];
+        bool                 active[8] = {};
+        const unsigned char* blocks[8];
+        size_t               next = 0;
+        for (;;)
+        {
+            // Idle lanes take the next messages
+            int busy = 0;
+            for (int j = 0; j < 8; ++j)
+            {
+                if (!active[j] && next < messages.size())
+                {
+                    lanes[j].start(messages[next], next);
+                    ++next;
+                    active[j] = true;
+                    for (int i = 0; i < 5; ++i) state[i][j] = initial_state[i];
+                }
+                busy += active[j];
+            }
+            if (!busy) break;
+
+            bool last[8] = {};
+            for (int j = 0; j < 8; ++j)
+            {
+                blocks[j] = active[j] ? lanes[j].next(last[j]) : idle_block;
+            }
+            compress8(state, blocks);
+            for (int j = 0; j < 8; ++j)
+            {
+                if (!last[j]) continue;
+                Sha1Batch::Digest& d = digests[lanes[j].index];
+                for (int i = 0; i < 5; ++i) d[i] = state[i][j];
+                active[j] = false;
+            }
+        }
+    }
+#endif
+}
+
+vector<Sha1Batch::Digest> Sha1Batch::hash(const vector<string_view>& messages)
+{
+    vector<Digest> digests(messages.size());
+#ifdef SHA1_X86
+    if (parallel())
+    {
+        hash8(messages, digests);
+        return digests;
+    }
+#endif
+
+    for (size_t i = 0; i < messages.size(); ++i)
+    {
+        Sha1 sha;
+        sha.update(messages[i].data(), messages[i].size());
+        sha.result();
+        copy(sha.Message_Digest, sha.Message_Digest + 5, digests[i].begin());
+    }
+    return digests;
+}
+
+bool Sha1Batch::parallel()
+{
+#ifdef SHA1_X86
+    static const bool avx2 = has_avx2();
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+bool Sha1::accelerated()
+{
+#ifdef SHA1_X86
+    return selected_compress() == compress_shani;
+#else
+    return false;
+#endif
+}
+
+Sha1::Sha1()
+{
+    reset();
+}
+
 Sha1::Sha1(const string& data)
 {
     reset();
@@ -56,8 +561,7 @@ Sha1::Sha1(const string& data)
 // for computing a new message digest.
 void Sha1::reset()
 {
-    Length_Low             = 0;
-    Length_High            = 0;
+    Length                 = 0;
     Message_Block_Index    = 0;
 
     Message_Digest[0]      = 0x67452301;
@@ -90,6 +594,11 @@ int Sha1::result()
     return 1;
 }
 
+void Sha1::update(const string& data)
+{
+    update(data.data(), data.size());
+}
+
 /*  
  *  update
  *
@@ -98,176 +607,54 @@ int Sha1::result()
  *      the message.
  *
  *  Parameters:
- *      message_array: [in]
- *          An array of characters representing the next portion of the
- *          message.
- *      length: [in]
- *          The length of the message in message_array
+ *      data: [in]
+ *          The next portion of the message.
+ *      size: [in]
+ *          The length of the message in data
  *
  *  Returns:
  *      Nothing.
  *
  *  Comments:
+ *      Updating a computed digest corrupts it.
  *
  */
-void Sha1::update(const string& data)
+void Sha1::update(const void* data, size_t size)
 {
-    if (data.empty())
+    if (!size)
     {
         return;
     }
 
-    const char* message_array = data.c_str();
-    long        length        = data.size();
-
     if (Computed || Corrupted)
     {
         Corrupted = 1;
         return;
     }
 
-    while(length-- && !Corrupted)
-    {
-        Message_Block[Message_Block_Index++] = (*message_array & 0xFF);
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    Length += size;
 
-        Length_Low += 8;
-        /* Force it to 32 bits */
-        Length_Low &= 0xFFFFFFFF;
-        if (Length_Low == 0)
-        {
-            Length_High++;
-            /* Force it to 32 bits */
-            Length_High &= 0xFFFFFFFF;
-            if (Length_High == 0)
-            {
-                /* Message is too long */
-                Corrupted = 1;
-            }
-        }
-
-        if (Message_Block_Index == 64)
-        {
-            processMessageBlock();
-        }
-
-        message_array++;
-    }
-}
-
-/*  
- *  processMessageBlock
- *
- *  Description:
- *      This function will process the next 512 bits of the message
- *      stored in the Message_Block array.
- *
- *  Parameters:
- *      None.
- *
- *  Returns:
- *      Nothing.
- *
- *  Comments:
- *      Many of the variable names in the SHAContext, especially the
- *      single character names, were used because those were the names
- *      used in the publication.
- *         
- *
- */
-void Sha1::processMessageBlock()
-{
-    const unsigned K[] =            /* Constants defined in SHA-1   */      
-    {
-        0x5A827999,
-        0x6ED9EBA1,
-        0x8F1BBCDC,
-        0xCA62C1D6
-    };
-    int         t;                  /* Loop counter                 */
-    unsigned    temp;               /* Temporary word value         */
-    unsigned    W[80];              /* Word sequence                */
-    unsigned    A, B, C, D, E;      /* Word buffers                 */
-
-    /*
-     *  Initialize the first 16 words in the array W
-     */
-    for(t = 0; t < 16; t++)
-    {
-        W[t] = ((unsigned) Message_Block[t * 4]) << 24;
-        W[t] |= ((unsigned) Message_Block[t * 4 + 1]) << 16;
-        W[t] |= ((unsigned) Message_Block[t * 4 + 2]) << 8;
-        W[t] |= ((unsigned) Message_Block[t * 4 + 3]);
-    }
-
-    for(t = 16; t < 80; t++)
-    {
-       W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
-
-    A = Message_Digest[0];
-    B = Message_Digest[1];
-    C = Message_Digest[2];
-    D = Message_Digest[3];
-    E = Message_Digest[4];
-
-    for(t = 0; t < 20; t++)
+    // Complete the pending partial block first
+    if (Message_Block_Index)
     {
-        temp =  SHA1CircularShift(5,A) +
-                ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
+        size_t n = 64 - Message_Block_Index;
+        if (n > size) n = size;
+        memcpy(Message_Block + Message_Block_Index, p, n);
+        Message_Block_Index += n;
+        p    += n;
+        size -= n;
+        if (Message_Block_Index < 64) return;
+        compress(Message_Digest, Message_Block, 1);
+        Message_Block_Index = 0;
     }
 
-    for(t = 20; t < 40; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+    // Then the whole blocks, in place
+    compress(Message_Digest, p, size / 64);
+    p += size - size % 64;
 
-    for(t = 40; t < 60; t++)
-    {
-        temp = SHA1CircularShift(5,A) +
-               ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
-
-    for(t = 60; t < 80; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
-
-    Message_Digest[0] =
-                        (Message_Digest[0] + A) & 0xFFFFFFFF;
-    Message_Digest[1] =
-                        (Message_Digest[1] + B) & 0xFFFFFFFF;
-    Message_Digest[2] =
-                        (Message_Digest[2] + C) & 0xFFFFFFFF;
-    Message_Digest[3] =
-                        (Message_Digest[3] + D) & 0xFFFFFFFF;
-    Message_Digest[4] =
-                        (Message_Digest[4] + E) & 0xFFFFFFFF;
-
-    Message_Block_Index = 0;
+    memcpy(Message_Block, p, size % 64);
+    Message_Block_Index = size % 64;
 }
 
 /*  
@@ -279,13 +666,11 @@ void Sha1::processMessageBlock()
  *      bits represent the length of the original message.  All bits in
  *      between should be 0.  This function will pad the message
  *      according to those rules by filling the Message_Block array
- *      accordingly.  It will also call processMessageBlock()
- *      appropriately.  When it returns, it can be assumed that the
- *      message digest has been computed.
+ *      accordingly, and compress the last block(s).  When it returns,
+ *      it can be assumed that the message digest has been computed.
  *
  *  Parameters:
- *      context: [in/out]
- *          The context to pad
+ *      None.
  *
  *  Returns:
  *      Nothing.
@@ -301,41 +686,25 @@ void Sha1::padMessage()
      *  block, process it, and then continue padding into a second
      *  block.
      */
-    if (Message_Block_Index > 55)
-    {
-        Message_Block[Message_Block_Index++] = 0x80;
-        while(Message_Block_Index < 64)
-        {
-            Message_Block[Message_Block_Index++] = 0;
-        }
-
-        processMessageBlock();
-
-        while(Message_Block_Index < 56)
-        {
-            Message_Block[Message_Block_Index++] = 0;
-        }
-    }
-    else
+    Message_Block[Message_Block_Index++] = 0x80;
+    if (Message_Block_Index > 56)
     {
-        Message_Block[Message_Block_Index++] = 0x80;
-        while(Message_Block_Index < 56)
-        {
-            Message_Block[Message_Block_Index++] = 0;
-        }
+        memset(Message_Block + Message_Block_Index, 0,
+               64 - Message_Block_Index);
+        compress(Message_Digest, Message_Block, 1);
+        Message_Block_Index = 0;
     }
+    memset(Message_Block + Message_Block_Index, 0, 56 - Message_Block_Index);
 
     /*
-     *  Store the message length as the last 8 octets
+     *  Store the message length in bits as the last 8 octets
      */
-    Message_Block[56] = (Length_High >> 24) & 0xFF;
-    Message_Block[57] = (Length_High >> 16) & 0xFF;
-    Message_Block[58] = (Length_High >> 8) & 0xFF;
-    Message_Block[59] = (Length_High) & 0xFF;
-    Message_Block[60] = (Length_Low >> 24) & 0xFF;
-    Message_Block[61] = (Length_Low >> 16) & 0xFF;
-    Message_Block[62] = (Length_Low >> 8) & 0xFF;
-    Message_Block[63] = (Length_Low) & 0xFF;
-
-    processMessageBlock();
+    uint64_t bits = Length * 8;
+    for (int i = 0; i < 8; ++i)
+    {
+        Message_Block[63 - i] = (bits >> (8 * i)) & 0xFF;
+    }
+
+    compress(Message_Digest, Message_Block, 1);
+    Message_Block_Index = 0;
 }
@@ -17,38 +17,63 @@
  *      single character names, were used because those were the names
  *      used in the publication.
  *
- *      Please read the file sha1.c for more information.
+ *      Please read the file sha1.cpp for more information.
  *
  */
 
 #ifndef _SHA1_H_
 #define _SHA1_H_
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 class Sha1
 {
 public:
+    Sha1();
     Sha1(const std::string& data);
     void reset();
     void update(const std::string& data);
+    void update(const void* data, size_t size);
     int  result();
 
+    // Whether blocks are compressed with the x86 SHA extensions
+    static bool accelerated();
+
     unsigned Message_Digest[5]; /* Message Digest (output)          */
 
 private:
-    void processMessageBlock();
     void padMessage();
 
-    unsigned Length_Low;        /* Message length in bits           */
-    unsigned Length_High;       /* Message length in bits           */
+    uint64_t Length;            /* Message length in bytes          */
 
-    unsigned char Message_Block[64]; /* 512-bit message blocks      */
+    unsigned char Message_Block[64]; /* Partial 512-bit block       */
     int Message_Block_Index;    /* Index into message block array   */
 
     int Computed;               /* Is the digest computed?          */
     int Corrupted;              /* Is the message digest corruped?  */
 };
 
+// Hashes many independent messages at once. With AVX2, messages are
+// processed 8 at a time, one per 32-bit lane, each lane taking the next
+// message as soon as its own is done. Otherwise, they are hashed one by one
+// with Sha1.
+class Sha1Batch
+{
+public:
+    typedef std::array<unsigned, 5> Digest;
+
+    // Returns the digests of the messages, in the same order
+    static std::vector<Digest> hash(
+        const std::vector<std::string_view>& messages);
+
+    // Whether the 8-lane implementation is used
+    static bool parallel();
+};
+
 #endif
 
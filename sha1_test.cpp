@@ -0,0 +1,166 @@
+// Tests of SHA-1 against the FIPS 180 examples, and of Sha1Batch against
+// Sha1: prints the failed checks, and exits with a non-zero status if there
+// are any. Built twice by the Makefile, with the x86 code paths (used if the
+// processor has them) and with SHA1_PORTABLE.
+
+#include "sha1.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    int failures = 0;
+
+    void expect(bool cond, const string& what)
+    {
+        if (cond) return;
+        cout << "FAILED: " << what << endl;
+        ++failures;
+    }
+
+    string hex(const unsigned* digest)
+    {
+        char buf[41];
+        for (int i = 0; i < 5; ++i) snprintf(buf + 8 * i, 9, "%08x", digest[i]);
+        return buf;
+    }
+
+    class Vector
+    {
+    public:
+        const char* name;
+        string      message;
+        const char* digest;
+    };
+
+    const Vector vectors[] = {
+        {"empty", "", "da39a3ee5e6b4b0d3255bfef95601890afd80709"},
+        {"abc", "abc", "a9993e364706816aba3e25717850c26c9cd0d89d"},
+        {"448-bit",
+         "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+         "84983e441c3bd26ebaae4aa1f95129e5e54670f1"},
+        {"896-bit",
+         "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+         "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+         "a49b2446a02c645bf419f995b67091253a04a259"},
+        {"million a", string(1000000, 'a'),
+         "34aa973cd4c4daa4f61eeb2bdbad27316534016f"},
+    };
+
+    // Hashes the message with one update() call per "chunk" bytes
+    string hash_chunked(const string& message, size_t chunk)
+    {
+        Sha1 sha;
+        for (size_t i = 0; i < message.size(); i += chunk)
+        {
+            sha.update(message.data() + i, min(chunk, message.size() - i));
+        }
+        sha.result();
+        return hex(sha.Message_Digest);
+    }
+
+    // Hashes the message with two update() calls, split at "at"
+    string hash_split(const string& message, size_t at)
+    {
+        Sha1 sha;
+        sha.update(message.data(), at);
+        sha.update(message.data() + at, message.size() - at);
+        sha.result();
+        return hex(sha.Message_Digest);
+    }
+
+    void test_sha1()
+    {
+        for (const Vector& v : vectors)
+        {
+            Sha1 sha(v.message);
+            sha.result();
+            expect(hex(sha.Message_Digest) == v.digest,
+                   string("Sha1 of ") + v.name);
+
+            // Partial blocks ending before, at and after the 55/56-byte
+            // padding limit and the 64-byte block end
+            const size_t chunks[] = {1, 3, 54, 55, 56, 57, 63, 64, 65, 1000};
+            for (size_t chunk : chunks)
+            {
+                expect(hash_chunked(v.message, chunk) == v.digest,
+                       string("Sha1 of ") + v.name + " in chunks of " +
+                           to_string(chunk));
+            }
+
+            size_t splits = min(v.message.size(), size_t(130));
+            for (size_t at = 0; at <= splits; ++at)
+            {
+                expect(hash_split(v.message, at) == v.digest,
+                       string("Sha1 of ") + v.name + " split at " +
+                           to_string(at));
+            }
+        }
+
+        Sha1 sha("abc");
+        sha.result();
+        sha.reset();
+        sha.update("abc");
+        sha.result();
+        expect(hex(sha.Message_Digest) == vectors[1].digest,
+               "Sha1 after reset()");
+    }
+
+    void test_batch()
+    {
+        // More messages than lanes, of unequal lengths (around the block
+        // boundaries, so that lanes finish at different blocks and take the
+        // next message at different times)
+        const size_t lengths[] = {0,   3,   55, 56, 63,  64, 65, 119, 120,
+                                  128, 200, 1,  57, 300, 0,  64, 1000, 55,
+                                  9};
+        vector<string> messages;
+        for (size_t i = 0; i < size(lengths); ++i)
+        {
+            string message(lengths[i], ' ');
+            for (size_t j = 0; j < message.size(); ++j)
+            {
+                message[j] = char('a' + (i + j * 7) % 26);
+            }
+            messages.push_back(message);
+        }
+
+        for (size_t count : {size_t(0), size_t(1), size_t(7), size_t(8),
+                             size(lengths)})
+        {
+            vector<string_view> views(messages.begin(),
+                                      messages.begin() + count);
+            vector<Sha1Batch::Digest> digests = Sha1Batch::hash(views);
+            expect(digests.size() == count,
+                   "Sha1Batch returns one digest per message");
+            for (size_t i = 0; i < min(count, digests.size()); ++i)
+            {
+                Sha1 sha(messages[i]);
+                sha.result();
+                expect(hex(digests[i].data()) == hex(sha.Message_Digest),
+                       "Sha1Batch of " + to_string(count) + " messages, #" +
+                           to_string(i) + " (" + to_string(lengths[i]) +
+                           " bytes)");
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_sha1();
+    test_batch();
+    if (failures) return 1;
+    cout << "sha1_test: OK ("
+         << (Sha1::accelerated() ? "SHA extensions" : "portable") << ", "
+         << (Sha1Batch::parallel() ? "8 lanes" : "one by one") << ")"
+         << endl;
+    return 0;
+}
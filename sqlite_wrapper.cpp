@@ -3,7 +3,8 @@
 
 using namespace std;
 
-Sqlite::Stmt::Stmt(sqlite3_stmt* stmt) : stmt_(stmt)
+Sqlite::Stmt::Stmt(sqlite3_stmt* stmt, bool cached)
+    : stmt_(stmt), cached_(cached), in_use_(false)
 {
 }
 
@@ -25,14 +26,87 @@ int Sqlite::Stmt::column_int(int col)
     return sqlite3_column_int(stmt_, col);
 }
 
+void Sqlite::Stmt::reset()
+{
+    sqlite3_reset(stmt_);
+    sqlite3_clear_bindings(stmt_);
+}
+
+void Sqlite::Stmt::bind_text(int idx, string_view value, bool copy)
+{
+    // A default-constructed view has no data, which would bind NULL
+    const char* data = value.data() ? value.data() : "";
+    int rc = sqlite3_bind_text(stmt_, idx, data, value.size(),
+                               copy ? SQLITE_TRANSIENT : SQLITE_STATIC);
+    CHECK(rc == SQLITE_OK, "Can't bind parameter %d: %d", idx, rc)
+}
+
+void Sqlite::Stmt::bind_int64(int idx, int64_t value)
+{
+    int rc = sqlite3_bind_int64(stmt_, idx, value);
+    CHECK(rc == SQLITE_OK, "Can't bind parameter %d: %d", idx, rc)
+}
+
+void Sqlite::Stmt::bind_double(int idx, double value)
+{
+    int rc = sqlite3_bind_double(stmt_, idx, value);
+    CHECK(rc == SQLITE_OK, "Can't bind parameter %d: %d", idx, rc)
+}
+
+void Sqlite::Stmt::bind_null(int idx)
+{
+    int rc = sqlite3_bind_null(stmt_, idx);
+    CHECK(rc == SQLITE_OK, "Can't bind parameter %d: %d", idx, rc)
+}
+
 int64_t Sqlite::Stmt::column_int64(int col)
 {
     return sqlite3_column_int64(stmt_, col);
 }
 
+double Sqlite::Stmt::column_double(int col)
+{
+    return sqlite3_column_double(stmt_, col);
+}
+
 string Sqlite::Stmt::column_text(int col)
 {
-    return reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
+    return string(column_view(col));
+}
+
+string_view Sqlite::Stmt::column_view(int col)
+{
+    const char* text =
+        reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
+    if (!text) return string_view();
+    return string_view(text, sqlite3_column_bytes(stmt_, col));
+}
+
+void Sqlite::StmtRelease::operator()(Stmt* stmt) const
+{
+    if (!stmt->cached_)
+    {
+        delete stmt;
+        return;
+    }
+    stmt->reset();
+    stmt->in_use_ = false;
+}
+
+Sqlite::Blob::~Blob()
+{
+    sqlite3_blob_close(blob_);
+}
+
+int64_t Sqlite::Blob::size()
+{
+    return sqlite3_blob_bytes(blob_);
+}
+
+void Sqlite::Blob::read(char* buf, int64_t n, int64_t offset)
+{
+    int rc = sqlite3_blob_read(blob_, buf, n, offset);
+    CHECK(rc == SQLITE_OK, "Can't read blob: %d", rc)
 }
 
 Sqlite::Sqlite() : db(NULL)
@@ -41,6 +115,9 @@ Sqlite::Sqlite() : db(NULL)
 
 Sqlite::~Sqlite()
 {
+    // The cached statements must be finalized before closing
+    cache_.clear();
+    sqlite3_close(db);
 }
 
 void Sqlite::exec(const string& sql, int (*callback)(void*,int,char**,char**),
@@ -50,22 +127,45 @@ void Sqlite::exec(const string& sql, int (*callback)(void*,int,char**,char**),
     CHECK(rc == SQLITE_OK, "Can't execute: %s (%d)", errmsg(), rc)
 }
 
-std::shared_ptr<Sqlite::Stmt> Sqlite::prepare_v2(const string& sql, int nByte,
-                                                 const char **pzTail)
+Sqlite::CachedStmt Sqlite::prepare(const string& sql)
+{
+    auto it = cache_.find(sql);
+    if (it == cache_.end())
+    {
+        unique_ptr<Stmt> stmt(new Stmt(compile(sql), true));
+        it = cache_.insert(make_pair(sql, move(stmt))).first;
+    }
+
+    Stmt* stmt = it->second.get();
+    if (stmt->in_use_) return CachedStmt(new Stmt(compile(sql), false));
+    stmt->in_use_ = true;
+    return CachedStmt(stmt);
+}
+
+sqlite3_stmt* Sqlite::compile(const string& sql)
 {
     sqlite3_stmt* stmt = NULL;
-    int rc = sqlite3_prepare_v2(db, sql.c_str(), nByte, &stmt, pzTail);
+    int rc = sqlite3_prepare_v2(db, sql.c_str(), sql.size() + 1, &stmt, 0);
     CHECK(rc == SQLITE_OK, "Can't prepare statement: %s, (%d)",
           errmsg(), rc);
-    return make_shared<Stmt>(stmt);
+    return stmt;
 }
 
 void Sqlite::open(const string& path)
 {
-    int rc = sqlite3_open(path.c_str(), &db);
+    // Each connection is used by a single thread at a time, so SQLite's
+    // per-connection mutexes are not needed
+    int rc = sqlite3_open_v2(path.c_str(), &db,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                             SQLITE_OPEN_NOMUTEX, NULL);
     CHECK(!rc, "Can't open database: %s", errmsg())
 }
 
+void Sqlite::busy_timeout(int ms)
+{
+    sqlite3_busy_timeout(db, ms);
+}
+
 const char* Sqlite::errmsg()
 {
     return sqlite3_errmsg(db);
@@ -73,7 +173,7 @@ const char* Sqlite::errmsg()
 
 int64_t Sqlite::random_int64()
 {
-    std::shared_ptr<Stmt> stmt = prepare_v2("select random()", -1, 0);
+    CachedStmt stmt = prepare("select random()");
     int rc = stmt->step();
     CHECK(rc == SQLITE_ROW, "Could not generate random number: %s (%d)",
           errmsg(), rc); 
@@ -85,3 +185,18 @@ int64_t Sqlite::last_rowid()
     return sqlite3_last_insert_rowid(db);
 }
 
+int64_t Sqlite::changes()
+{
+    return sqlite3_changes(db);
+}
+
+unique_ptr<Sqlite::Blob> Sqlite::open_blob(const char* table,
+                                           const char* column, int64_t rowid)
+{
+    sqlite3_blob* blob = NULL;
+    int rc = sqlite3_blob_open(db, "main", table, column, rowid, 0, &blob);
+    if (rc == SQLITE_ERROR && !blob) return nullptr; // No such row
+    CHECK(rc == SQLITE_OK, "Can't open blob: %s (%d)", errmsg(), rc)
+    return unique_ptr<Blob>(new Blob(blob));
+}
+
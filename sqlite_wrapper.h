@@ -1,41 +1,240 @@
 #ifndef SQLITE_WRAPPER_H
 #define SQLITE_WRAPPER_H
 
+#include <cstddef>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
 #include "sqlite3.h"
 
+// FTS5, used for the full-text index of the notes, first shipped in 3.9.0
+static_assert(SQLITE_VERSION_NUMBER >= 3009000, "SQLite 3.9.0 or later is "
+              "required");
+
 class Sqlite
 {
 public:
     class Stmt
     {
     public:
-        Stmt(sqlite3_stmt* stmt);
+        Stmt(sqlite3_stmt* stmt, bool cached);
         ~Stmt();
         int step();
+        void reset();
+
+        // Text is copied by SQLite unless "copy" is false, in which case it
+        // must stay valid until the statement is released or rebound
+        void bind_text(int idx, std::string_view value, bool copy = true);
+        void bind_int64(int idx, int64_t value);
+        void bind_double(int idx, double value);
+        void bind_null(int idx);
+
         int column_int(int col);
         int64_t column_int64(int col);
+        double column_double(int col);
         std::string column_text(int col);
 
+        // Zero-copy access to a text column, valid until the next step
+        std::string_view column_view(int col);
+
+        // Binds the arguments to parameters 1, 2, ...
+        template <typename... Args>
+        void bind_all([[maybe_unused]] bool copy, const Args&... args)
+        {
+            [[maybe_unused]] int idx = 0;
+            (bind_arg(++idx, args, copy), ...);
+        }
+
+        // Returns the columns of the current row, converted to Cols
+        template <typename... Cols>
+        std::tuple<Cols...> row()
+        {
+            return row_impl<Cols...>(std::index_sequence_for<Cols...>());
+        }
+
     private:
+        friend class Sqlite;
+
+        template <typename T>
+        std::enable_if_t<std::is_integral_v<T>>
+        bind_arg(int idx, T value, bool) { bind_int64(idx, value); }
+        void bind_arg(int idx, double value, bool) { bind_double(idx, value); }
+        void bind_arg(int idx, std::nullptr_t, bool) { bind_null(idx); }
+        void bind_arg(int idx, std::string_view value, bool copy)
+        {
+            bind_text(idx, value, copy);
+        }
+
+        void get(int col, int& v)              { v = column_int(col); }
+        void get(int col, int64_t& v)          { v = column_int64(col); }
+        void get(int col, double& v)           { v = column_double(col); }
+        void get(int col, std::string& v)      { v = column_text(col); }
+        void get(int col, std::string_view& v) { v = column_view(col); }
+
+        template <typename... Cols, size_t... I>
+        std::tuple<Cols...> row_impl(std::index_sequence<I...>)
+        {
+            std::tuple<Cols...> t;
+            (get(I, std::get<I>(t)), ...);
+            return t;
+        }
+
         sqlite3_stmt* stmt_;
+        bool          cached_;
+        bool          in_use_;
+    };
+
+    // Gives a statement back to the cache (resetting it and clearing its
+    // bindings), or finalizes it if it is not cached
+    class StmtRelease
+    {
+    public:
+        void operator()(Stmt* stmt) const;
+    };
+
+    typedef std::unique_ptr<Stmt, StmtRelease> CachedStmt;
+
+    // Result of query(): an input range over the rows, as tuples. Views on
+    // text columns are only valid until the iteration moves to the next row.
+    template <typename... Cols>
+    class Rows
+    {
+    public:
+        class iterator
+        {
+        public:
+            explicit iterator(Rows* rows) : rows_(rows) {}
+            std::tuple<Cols...> operator*()
+            {
+                return rows_->stmt_->template row<Cols...>();
+            }
+            iterator& operator++()
+            {
+                if (rows_->stmt_->step() != SQLITE_ROW) rows_ = nullptr;
+                return *this;
+            }
+            bool operator!=(const iterator& other) const
+            {
+                return rows_ != other.rows_;
+            }
+
+        private:
+            Rows* rows_;
+        };
+
+        explicit Rows(CachedStmt stmt) : stmt_(std::move(stmt)) {}
+
+        iterator begin()
+        {
+            return iterator(stmt_->step() == SQLITE_ROW ? this : nullptr);
+        }
+        iterator end() { return iterator(nullptr); }
+
+        // Returns the first row, if any. Use owning column types when the
+        // Rows object is a temporary.
+        std::optional<std::tuple<Cols...>> first()
+        {
+            if (stmt_->step() != SQLITE_ROW) return std::nullopt;
+            return stmt_->template row<Cols...>();
+        }
+
+    private:
+        CachedStmt stmt_;
+    };
+
+    // Incremental reads of a text or blob value (sqlite3_blob), which is
+    // not loaded whole. The row is read in the snapshot of the transaction
+    // open at the time; in autocommit mode, the handle keeps a read
+    // transaction open until it is destroyed.
+    class Blob
+    {
+    public:
+        explicit Blob(sqlite3_blob* blob) : blob_(blob) {}
+        ~Blob();
+        Blob(const Blob&) = delete;
+        Blob& operator=(const Blob&) = delete;
+
+        // Size in bytes
+        int64_t size();
+
+        // Reads n bytes from offset into buf
+        void read(char* buf, int64_t n, int64_t offset);
+
+    private:
+        sqlite3_blob* blob_;
     };
 
     Sqlite();
     ~Sqlite();
     void exec(const std::string& sql, int (*callback)(void*,int,char**,char**),
               void* arg1, char** error_msg);
-    std::shared_ptr<Stmt> prepare_v2(const std::string& sql, int nByte,
-                                     const char **pzTail);
+
+    // Returns the statement for "sql", which is compiled on first use and
+    // kept for the lifetime of the connection. Parameters ("?") are bound
+    // with the bind_* methods; bindings are cleared when the statement is
+    // released. If the statement is already in use (nested queries), a
+    // separate, uncached statement is returned.
+    CachedStmt prepare(const std::string& sql);
+
+    // Runs a cached statement with the given parameters, e.g.
+    //     for (auto [id, title] : db.query<int64_t, std::string_view>(
+    //              "SELECT id, title FROM note WHERE user=?", user))
+    // Text arguments are copied, as the rows may be iterated after the
+    // arguments are gone.
+    template <typename... Cols, typename... Args>
+    Rows<Cols...> query(const std::string& sql, const Args&... args)
+    {
+        CachedStmt stmt = prepare(sql);
+        stmt->bind_all(true, args...);
+        return Rows<Cols...>(std::move(stmt));
+    }
+
+    // Runs a cached statement and calls f(cols...) for each row. Arguments
+    // are bound without copying them.
+    template <typename... Cols, typename F, typename... Args>
+    void for_each_row(const std::string& sql, F&& f, const Args&... args)
+    {
+        CachedStmt stmt = prepare(sql);
+        stmt->bind_all(false, args...);
+        while (stmt->step() == SQLITE_ROW)
+        {
+            std::apply(f, stmt->template row<Cols...>());
+        }
+    }
+
+    // Runs a cached statement that returns no rows
+    template <typename... Args>
+    void execute(const std::string& sql, const Args&... args)
+    {
+        CachedStmt stmt = prepare(sql);
+        stmt->bind_all(false, args...);
+        while (stmt->step() == SQLITE_ROW) {}
+    }
+
     void open(const std::string& path);
+    void busy_timeout(int ms);
     const char* errmsg();
     int64_t random_int64();
     int64_t last_rowid();
 
+    // Number of rows changed by the last statement (not counting triggers)
+    int64_t changes();
+
+    // Opens a value for reading; returns null if there is no such row
+    std::unique_ptr<Blob> open_blob(const char* table, const char* column,
+                                    int64_t rowid);
+
 private:
+    sqlite3_stmt* compile(const std::string& sql);
+
     sqlite3* db;
+    std::unordered_map<std::string, std::unique_ptr<Stmt>> cache_;
 };
 
 #endif
@@ -1,14 +1,86 @@
 #include "util.h"
 
+#include <charconv>
 #include <cerrno>
 #include <cstring>
 #include <fstream>
 
 using namespace std;
 
-string fmt(const boost::format& f)
+namespace
 {
-    return boost::str(f);
+    void append_arg(string& out, const format_detail::Piece& p,
+                    const format_detail::Arg& a)
+    {
+        using format_detail::Arg;
+
+        char buf[32];
+        string_view s;
+        int base = p.conv == 'x' ? 16 : 10;
+        switch (a.kind)
+        {
+        case Arg::INT:
+            s = string_view(buf, to_chars(buf, end(buf), a.i, base).ptr - buf);
+            break;
+        case Arg::UINT:
+            s = string_view(buf, to_chars(buf, end(buf), a.u, base).ptr - buf);
+            break;
+        case Arg::DOUBLE:
+        {
+            // Shortest round-trip representation, in plain decimal notation
+            // unless too long
+            auto r = to_chars(buf, end(buf), a.d, chars_format::fixed);
+            if (r.ec != errc()) r = to_chars(buf, end(buf), a.d);
+            s = string_view(buf, r.ptr - buf);
+            break;
+        }
+        case Arg::STR:
+            s = a.s;
+            break;
+        case Arg::CHAR:
+            s = string_view(&a.c, 1);
+            break;
+        }
+
+        size_t pad = p.width > s.size() ? p.width - s.size() : 0;
+        if (!pad)
+        {
+            out += s;
+        }
+        else if (p.left)
+        {
+            out += s;
+            out.append(pad, ' ');
+        }
+        else if (p.fill == '0' && !s.empty() && s[0] == '-')
+        {
+            // The zeros go after the sign
+            out += '-';
+            out.append(pad, '0');
+            out += s.substr(1);
+        }
+        else
+        {
+            out.append(pad, p.fill);
+            out += s;
+        }
+    }
+}
+
+void format_detail::format_error(const char* reason)
+{
+    throw logic_error(reason);
+}
+
+void format_detail::format(string& out, string_view str, const Piece* pieces,
+                           size_t count, const Arg* args)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Piece& p = pieces[i];
+        out.append(str.data() + p.text_pos, p.text_len);
+        if (p.arg >= 0) append_arg(out, p, args[p.arg]);
+    }
 }
 
 string get_file_contents(const string& filename)
@@ -2,38 +2,227 @@
 #define UTIL_H
 
 #include <boost/foreach.hpp>
-#include <boost/format.hpp>
+#include <cstddef>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
 #define CHECK(cond, msg, ...) if (!(cond)) error(msg, __FILE__, __FUNCTION__,\
                                                  __LINE__, ##__VA_ARGS__);
 
 #define foreach_ BOOST_FOREACH
 
-std::string fmt(const boost::format& f);
+namespace format_detail
+{
+    // Literal text of a format string, followed by an argument (if arg is
+    // not negative) with its conversion: 0 (default), 'd', 's', 'u' or 'x'
+    class Piece
+    {
+    public:
+        uint16_t text_pos;
+        uint16_t text_len;
+        int8_t   arg;
+        char     conv;
+        char     fill;
+        uint8_t  width;
+        bool     left;
+    };
+
+    const size_t max_pieces = 24;
+
+    // Called (at compile time) on invalid format strings: not being
+    // constexpr, it makes the compilation fail, with the reason in the
+    // error message
+    void format_error(const char* reason);
+
+    // Format argument, without its type
+    class Arg
+    {
+    public:
+        enum Kind { INT, UINT, DOUBLE, STR, CHAR };
+
+        Arg() : kind(INT), i(0) {}
+        Arg(bool b) : kind(INT), i(b) {}
+        Arg(char c) : kind(CHAR), c(c) {}
+        Arg(double d) : kind(DOUBLE), d(d) {}
+        Arg(float d) : kind(DOUBLE), d(d) {}
+        Arg(const char* s) : kind(STR), s(s) {}
+        Arg(const std::string& s) : kind(STR), s(s) {}
+        Arg(std::string_view s) : kind(STR), s(s) {}
+
+        template <typename T,
+                  typename = std::enable_if_t<std::is_integral_v<T>>>
+        Arg(T n)
+        {
+            if constexpr (std::is_signed_v<T>)
+            {
+                kind = INT;
+                i    = n;
+            }
+            else
+            {
+                kind = UINT;
+                u    = n;
+            }
+        }
+
+        Kind kind;
+        union
+        {
+            int64_t          i;
+            uint64_t         u;
+            double           d;
+            std::string_view s;
+            char             c;
+        };
+    };
+
+    void format(std::string& out, std::string_view str, const Piece* pieces,
+                size_t count, const Arg* args);
+}
 
-template <typename T, typename... Ts>
-std::string fmt(boost::format& f, const T& arg, Ts... args)
+// Format string for N arguments, parsed and checked at compile time. The
+// arguments are referred to either by position ("%1%", "%2%"...) or in
+// order with printf-like conversions ("%d", "%s", "%08x"...); "%%" is a
+// percent sign. All the arguments must be used.
+template <size_t N>
+class FormatString
 {
-    return fmt(f % arg, args...);
+public:
+    template <size_t L>
+    consteval FormatString(const char (&s)[L])
+        : str(s, L - 1), pieces{}, count(0)
+    {
+        using format_detail::format_error;
+
+        bool   positional = false;
+        bool   sequential = false;
+        size_t next_arg   = 0;
+        bool   used[N + 1] = {};
+        size_t text_pos   = 0;
+        size_t i          = 0;
+        while (i < str.size())
+        {
+            if (str[i] != '%')
+            {
+                ++i;
+                continue;
+            }
+            if (i + 1 < str.size() && str[i + 1] == '%')
+            {
+                // Literal '%': ends the text, which restarts at the second
+                // one
+                add(text_pos, i + 1 - text_pos, -1, 0, ' ', 0, false);
+                i += 2;
+                text_pos = i;
+                continue;
+            }
+
+            size_t start = i++;
+            bool left = false;
+            char fill = ' ';
+            for (; i < str.size() && (str[i] == '-' || str[i] == '0'); ++i)
+            {
+                if (str[i] == '-') left = true;
+                else               fill = '0';
+            }
+            size_t number = 0;
+            size_t digits = 0;
+            for (; i < str.size() && str[i] >= '0' && str[i] <= '9'; ++i)
+            {
+                number = number * 10 + (str[i] - '0');
+                ++digits;
+            }
+            if (i == str.size()) format_error("unterminated placeholder");
+
+            size_t arg;
+            char   conv = str[i++];
+            size_t width = 0;
+            if (conv == '%')
+            {
+                if (left || fill != ' ' || !digits || !number)
+                {
+                    format_error("invalid positional placeholder");
+                }
+                positional = true;
+                arg        = number - 1;
+                conv       = 0;
+            }
+            else
+            {
+                if (conv != 'd' && conv != 's' && conv != 'u' && conv != 'x')
+                {
+                    format_error("unsupported conversion");
+                }
+                sequential = true;
+                arg        = next_arg++;
+                width      = number;
+            }
+            if (positional && sequential)
+            {
+                format_error("positional and sequential placeholders mixed");
+            }
+            if (arg >= N) format_error("not enough arguments");
+            if (width > 255) format_error("width too large");
+            used[arg] = true;
+            add(text_pos, start - text_pos, arg, conv, fill, width, left);
+            text_pos = i;
+        }
+        add(text_pos, str.size() - text_pos, -1, 0, ' ', 0, false);
+        for (size_t a = 0; a < N; ++a)
+        {
+            if (!used[a]) format_error("unused argument");
+        }
+    }
+
+    std::string_view     str;
+    format_detail::Piece pieces[format_detail::max_pieces];
+    size_t               count;
+
+private:
+    consteval void add(size_t text_pos, size_t text_len, int arg, char conv,
+                       char fill, size_t width, bool left)
+    {
+        if (count == format_detail::max_pieces)
+        {
+            format_detail::format_error("too many placeholders");
+        }
+        pieces[count++] = format_detail::Piece{uint16_t(text_pos),
+                                               uint16_t(text_len),
+                                               int8_t(arg), conv, fill,
+                                               uint8_t(width), left};
+    }
+};
+
+// Appends the formatted arguments to "out"
+template <typename... Ts>
+void fmt_to(std::string& out, const FormatString<sizeof...(Ts)>& f,
+            const Ts&... args)
+{
+    const format_detail::Arg a[sizeof...(Ts) + 1] = {args...};
+    format_detail::format(out, f.str, f.pieces, f.count, a);
 }
 
 template <typename... Ts>
-std::string fmt(const std::string& s, Ts... args)
+std::string fmt(const FormatString<sizeof...(Ts)>& f, const Ts&... args)
 {
-    boost::format f(s);
-    return fmt(f, args...);
+    std::string s;
+    fmt_to(s, f, args...);
+    return s;
 }
 
 template <typename... Ts>
-void error(const char* msg, const char* file, const char* func, long line, Ts... args)
+[[noreturn]] void error(const FormatString<sizeof...(Ts)>& msg,
+                        const char* file, const char* func, long line,
+                        const Ts&... args)
 {
-    throw std::runtime_error(fmt("%1% [%2%!%3%:%4%]", fmt(msg, args...),
-                             file, func, line));
+    std::string s = fmt(msg, args...);
+    fmt_to(s, " [%1%!%2%:%3%]", file, func, line);
+    throw std::runtime_error(s);
 }
 
 std::string get_file_contents(const std::string& filename);
 
 #endif
-
@@ -0,0 +1,72 @@
+#include "worker_pool.h"
+#include "util.h"
+
+#include <iostream>
+
+using namespace std;
+
+WorkerPool::WorkerPool(size_t threads, const string& db_path,
+                       LogWriter* log_writer, SessionCache* session_cache)
+    : stop_(false)
+{
+    if (threads == 0) threads = thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+
+    // Open the connections up front, so that errors reach the caller
+    for (size_t i = 0; i < threads; ++i)
+    {
+        dbs_.push_back(unique_ptr<DB>(new DB(db_path)));
+        dbs_.back()->set_log_writer(log_writer);
+        dbs_.back()->set_session_cache(session_cache);
+    }
+    for (size_t i = 0; i < threads; ++i)
+    {
+        DB& db = *dbs_[i];
+        threads_.push_back(thread([this, &db] { work(db); }));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    foreach_(auto& t, threads_) t.join();
+}
+
+void WorkerPool::submit(Job job)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        jobs_.push_back(move(job));
+    }
+    cond_.notify_one();
+}
+
+void WorkerPool::work(DB& db)
+{
+    for (;;)
+    {
+        Job job;
+        {
+            unique_lock<mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;
+            job = move(jobs_.front());
+            jobs_.pop_front();
+        }
+
+        try
+        {
+            job(db);
+        }
+        catch (const std::exception& ex)
+        {
+            // Jobs report their own errors; never let one kill the worker
+            cerr << "Worker job failed: " << ex.what() << endl;
+        }
+    }
+}
+
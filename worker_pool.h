@@ -0,0 +1,49 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "db.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads, each owning its own connection to the
+// database. Submitted jobs are queued and picked up by the first idle
+// worker, which runs them with its connection.
+class WorkerPool
+{
+public:
+    typedef std::function<void(DB& db)> Job;
+
+    // Opens one connection per thread (a count of 0 means one per core).
+    // The connections log requests through log_writer and keep sessions in
+    // session_cache, if given.
+    WorkerPool(size_t threads, const std::string& db_path,
+               LogWriter* log_writer = NULL,
+               SessionCache* session_cache = NULL);
+
+    // Waits for the queued jobs to complete
+    ~WorkerPool();
+
+    void submit(Job job);
+
+    size_t size() const { return threads_.size(); }
+
+private:
+    void work(DB& db);
+
+    std::vector<std::unique_ptr<DB>> dbs_;
+    std::vector<std::thread>         threads_;
+    std::mutex                       mutex_;
+    std::condition_variable          cond_;
+    std::deque<Job>                  jobs_;
+    bool                             stop_;
+};
+
+#endif
+